@@ -3,4 +3,4 @@
 # Given a libsndfile compiled with escripten, compile libop1 to javascript,
 # exporting the right symbols.
 
-emcc --bind -std=c++11 -s EXPORTED_FUNCTIONS="`sh function-names.sh`" -Ivendor -Isrc -Iinclude -Iexternal/include  src/op1_drum_impl.cpp ../emout/lib/libsndfile.a -o libop1.js
+emcc --bind -std=c++11 -s EXPORTED_FUNCTIONS="`sh function-names.sh`" -Ivendor -Isrc -Iinclude -Iexternal/include  src/op1_drum_impl.cpp src/op1_aiff.cpp src/op1_alloc.cpp src/op1_appl.cpp src/op1_dsp.cpp src/op1_log.cpp src/op1_mmap.cpp src/op1_resample.cpp ../emout/lib/libsndfile.a -o libop1.js
@@ -2,7 +2,19 @@
 #define OP1_H_
 
 /** @file
- *     The <tt>libop1</tt> C API. */
+ *     The <tt>libop1</tt> C API.
+ *
+ * Threads: different `op1_drum` can be used on different threads at the same
+ * time, but each one by a single thread at a time. An `audio_file` can be
+ * added to kits on several threads and exported from all of them at once, as
+ * long as no thread changes it or gets its data meanwhile
+ * (`op1_sample_normalize`, `op1_sample_trim`, `op1_sample_get_data`,
+ * `op1_sample_get_float_data`). Retaining and destroying it is always safe.
+ * The only state shared by the whole process is the log callback and the
+ * decode cache, that can be used from any thread, and the allocator.
+ *
+ * No function exits the process: running out of memory makes the call return
+ * `OP1_ERROR`, and leaves its arguments as they were. */
 
 
 #include <stdlib.h>
@@ -33,9 +45,166 @@ struct op1_drum;
 enum {
   OP1_SUCCESS = 0, ///< The API call succeeded.
   OP1_ERROR = -1,  ///< Generic error
-  OP1_ARGUMENT_ERROR = -2 ///< One or more arguments passed was invalid.
+  OP1_ARGUMENT_ERROR = -2, ///< One or more arguments passed was invalid.
+  OP1_BUFFER_TOO_SMALL = -3, ///< The output buffer passed in is too small.
+  OP1_IO_ERROR = -4, ///< Reading or writing data failed.
+  OP1_OVER_BUDGET = -5 ///< The drum kit is longer than an OP-1 can hold.
+};
+
+/**
+ * A function that receives the output of `op1_drum_write_stream`, in order,
+ * in chunks of bounded size.
+ *
+ * @param data The next chunk of the output file.
+ * @param length The size of the chunk.
+ * @param user_data The pointer passed to `op1_drum_write_stream`.
+ *
+ * @returns 0 on success, anything else to abort the export.
+ */
+typedef int (*op1_write_callback)(const uint8_t * data, size_t length, void * user_data);
+
+/**
+ * Levels of the messages of the library, from the most to the least severe.
+ *
+ * @see op1_set_log_callback
+ */
+enum OP1_LOG_LEVEL {
+  OP1_LOG_NONE = -1, ///< No message at all.
+  OP1_LOG_ERROR = 0, ///< Something failed.
+  OP1_LOG_WARNING = 1, ///< Something unexpected, that was worked around.
+  OP1_LOG_INFO = 2, ///< What the library does, once per operation.
+  OP1_LOG_DEBUG = 3 ///< Details of each step.
 };
 
+/**
+ * A function that receives the messages of the library. It can be called from
+ * any thread, and from several at once.
+ *
+ * @param level One of `OP1_LOG_LEVEL`.
+ * @param file The source file the message comes from.
+ * @param line The line in `file`.
+ * @param message The message, without a trailing newline.
+ * @param user_data The pointer passed to `op1_set_log_callback`.
+ */
+typedef void (*op1_log_callback)(int level, const char * file, int line, const char * message, void * user_data);
+
+/**
+ * What an `op1_drum` or `audio_file` has cost so far. Durations are in
+ * nanoseconds, and add up across operations.
+ *
+ * @see op1_sample_get_stats
+ * @see op1_drum_get_stats
+ */
+typedef struct op1_stats {
+  /**
+   * Decoding: the input file for samples, the 'op-1' document and the audio
+   * for kits read with `op1_drum_load`.
+   */
+  uint64_t decode_ns;
+  /**
+   * Sample-rate conversion, when loading samples or compressing kits with
+   * `op1_drum_fit`.
+   */
+  uint64_t convert_ns;
+  /**
+   * Writing the 'op-1' document of kits.
+   */
+  uint64_t serialize_ns;
+  /**
+   * Quantizing the audio of kits to 16-bit.
+   */
+  uint64_t encode_ns;
+  /**
+   * Assembling the file of kits from the header and the encoded audio.
+   */
+  uint64_t patch_ns;
+  /**
+   * Bytes read: the input file of samples, or their part of the file of a kit
+   * read with `op1_drum_load`, and the file of kits read with `op1_drum_load`.
+   * Unknown for files that can't be mapped in memory.
+   */
+  uint64_t bytes_in;
+  /**
+   * Bytes produced: the decoded audio of samples, the files written for kits.
+   */
+  uint64_t bytes_out;
+  /**
+   * Audio and output buffers allocated by the library.
+   */
+  uint64_t allocations;
+  /**
+   * Samples: 1 if it was copied from the decode cache. Kits: exports that
+   * reused the encoded audio of the previous one.
+   */
+  uint64_t cache_hits;
+  /**
+   * Samples: 1 if the decode cache was enabled but did not have it. Kits:
+   * exports that had to encode the audio.
+   */
+  uint64_t cache_misses;
+} op1_stats;
+
+/**
+ * Set the function that receives the messages of the library, for all the
+ * threads of the process. By default, warnings and errors are printed on the
+ * standard error. Libraries built with `OP1_NO_LOGGING` defined have no
+ * messages, at no cost.
+ *
+ * @param level The most detailed level passed to `callback`, one of
+ * `OP1_LOG_LEVEL`. `OP1_LOG_NONE` disables the messages.
+ * @param callback The function to call, or NULL to print on the standard
+ * error.
+ * @param user_data Passed to `callback`.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_set_log_callback(int level, op1_log_callback callback, void * user_data);
+
+/**
+ * Functions the library allocates its memory with, instead of `malloc` and
+ * `free`.
+ *
+ * @see op1_set_allocator
+ */
+typedef struct op1_allocator {
+  /**
+   * Return `size` bytes, aligned for any type, or NULL if they can't be
+   * allocated, in which case the call that needed them fails with
+   * `OP1_ERROR`. Can be called from any thread.
+   */
+  void * (*allocate)(size_t size, void * user_data);
+  /**
+   * Free memory returned by `allocate`, never NULL. Can be called from any
+   * thread.
+   */
+  void (*deallocate)(void * ptr, void * user_data);
+  /**
+   * Passed to both functions.
+   */
+  void * user_data;
+} op1_allocator;
+
+/**
+ * Set the functions that allocate all the memory the library holds, for the
+ * whole process: samples, drum contexts and their audio, the decode cache,
+ * and the buffers of `op1_drum_write_buffer`. Memory only used for the
+ * duration of a call, by libsndfile while decoding, to parse the 'op-1'
+ * document of kits read with `op1_drum_load`, and to format log messages,
+ * still comes from the global heap.
+ *
+ * Memory is always freed with the allocator that allocated it, so this can
+ * only be called while the library holds no memory: before using it, or once
+ * every sample, context and buffer has been destroyed and the decode cache
+ * disabled. It must not be called while other threads use the library.
+ *
+ * @param allocator The functions to use, copied, or NULL for `malloc` and
+ * `free`.
+ *
+ * @returns OP1_ERROR if the library still holds memory, an error code in case
+ * of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_set_allocator(const op1_allocator * allocator);
+
 /**
  * Special values to pass to `op1_drum_set_playmode`.
  *
@@ -86,9 +255,298 @@ enum OP1_PITCH {
   OP1_PITCH_CENTER = 0
 };
 
+/**
+ * How the audio is quantized to 16-bit when a drum kit is written, to pass to
+ * `op1_drum_set_dither`. Samples that are exactly representable in 16-bit,
+ * such as 16-bit files loaded without gain or sample-rate changes, are never
+ * dithered.
+ *
+ * @see op1_drum_set_dither
+ */
+enum OP1_DITHER {
+  /**
+   * Round to the nearest value.
+   */
+  OP1_DITHER_NONE = 0,
+  /**
+   * Triangular dither of one LSB, the default.
+   */
+  OP1_DITHER_TPDF = 1,
+  /**
+   * Triangular dither, with the noise shaped towards high frequencies.
+   */
+  OP1_DITHER_SHAPED = 2
+};
+
+/**
+ * The sample-rate of the OP-1. Samples are converted to this rate when loaded.
+ */
+enum OP1_SAMPLE_RATE {
+  OP1_SAMPLE_RATE = 44100
+};
+
+/**
+ * The quality of the sample-rate conversion applied when loading samples,
+ * to pass in `op1_sample_options`. Higher qualities use longer filters, and
+ * are slower.
+ *
+ * @see op1_sample_options
+ */
+enum OP1_RESAMPLE_QUALITY {
+  /**
+   * Keep the sample-rate of the file.
+   */
+  OP1_RESAMPLE_NONE = 0,
+  /**
+   * Short filters, for interactive use.
+   */
+  OP1_RESAMPLE_FAST = 1,
+  /**
+   * The default.
+   */
+  OP1_RESAMPLE_MEDIUM = 2,
+  /**
+   * Long filters, with the least aliasing.
+   */
+  OP1_RESAMPLE_BEST = 3
+};
+
+/**
+ * How files with more than one channel are converted to mono when loaded, to
+ * pass in `op1_sample_options`.
+ *
+ * @see op1_sample_options
+ */
+enum OP1_DOWNMIX {
+  /**
+   * The average of all the channels, the default.
+   */
+  OP1_DOWNMIX_AVERAGE = 0,
+  /**
+   * The first channel.
+   */
+  OP1_DOWNMIX_LEFT = 1,
+  /**
+   * The second channel, or the first one for mono files.
+   */
+  OP1_DOWNMIX_RIGHT = 2,
+  /**
+   * The average of the first two channels, ignoring the others.
+   */
+  OP1_DOWNMIX_MID = 3,
+  /**
+   * The channel that has the most energy over the whole file.
+   */
+  OP1_DOWNMIX_MAX_ENERGY = 4
+};
+
+/**
+ * The maximum number of frames of a drum kit, including the silent frame that
+ * follows each sample: 12 seconds at `OP1_SAMPLE_RATE`. Drum kits that are
+ * longer are not written, and can be shortened with `op1_drum_fit`.
+ *
+ * @see op1_drum_fit
+ */
+enum OP1_DRUM_BUDGET {
+  OP1_DRUM_MAX_FRAMES = 12 * 44100
+};
+
+/**
+ * How `op1_drum_fit` shortens a drum kit that is too long. Whatever the
+ * policy, the slots are then truncated if the kit is still too long.
+ *
+ * @see op1_drum_fit
+ */
+enum OP1_FIT_POLICY {
+  /**
+   * Truncate every slot by the same proportion, fading out the cut.
+   */
+  OP1_FIT_TRUNCATE = 0,
+  /**
+   * Drop the silence at the end of each slot.
+   */
+  OP1_FIT_TRIM_SILENCE = 1,
+  /**
+   * Speed up the longest slots, up to twice their speed. This raises their
+   * pitch.
+   */
+  OP1_FIT_COMPRESS = 2
+};
+
+/**
+ * What `op1_drum_fit` did to a slot.
+ *
+ * @see op1_fit_report
+ */
+typedef struct op1_fit_slot {
+  /**
+   * The length of the slot before fitting, in frames.
+   */
+  size_t frames_before;
+  /**
+   * The length of the slot after fitting, in frames.
+   */
+  size_t frames_after;
+  /**
+   * The number of frames faded out at the end of the slot.
+   */
+  size_t fade_frames;
+  /**
+   * How much the slot has been sped up, 1.0 if it has not.
+   */
+  float speed;
+} op1_fit_slot;
+
+/**
+ * What `op1_drum_fit` did to a drum kit.
+ *
+ * @see op1_drum_fit
+ */
+typedef struct op1_fit_report {
+  /**
+   * The length of the drum kit before fitting, in frames.
+   */
+  size_t frames_before;
+  /**
+   * The length of the drum kit after fitting, in frames, at most
+   * `OP1_DRUM_MAX_FRAMES`.
+   */
+  size_t frames_after;
+  /**
+   * The number of slots in use in `slots`.
+   */
+  size_t slot_count;
+  /**
+   * The changes made to each slot, in the order the samples were added.
+   */
+  op1_fit_slot slots[24];
+} op1_fit_report;
+
+/**
+ * One of the slices of a drum kit read with `op1_drum_load`, as a view into
+ * the audio of the file.
+ *
+ * @see op1_drum_get_slices
+ */
+typedef struct op1_slice {
+  /**
+   * The big-endian 16-bit mono audio of the slice, valid as long as the
+   * context it comes from.
+   */
+  const uint8_t * data;
+  /**
+   * The length of the slice, in frames. An empty slot has no frames.
+   */
+  size_t frame_count;
+  /**
+   * The first frame of the slice, in the audio of the kit.
+   */
+  size_t start;
+} op1_slice;
+
+/**
+ * How a sample is normalized, to pass to `op1_sample_normalize` or in
+ * `op1_sample_options`.
+ *
+ * @see op1_sample_normalize
+ */
+enum OP1_NORMALIZE {
+  /**
+   * Keep the level of the file, the default.
+   */
+  OP1_NORMALIZE_NONE = 0,
+  /**
+   * Bring the highest absolute value of the sample to the target level.
+   */
+  OP1_NORMALIZE_PEAK = 1,
+  /**
+   * Bring the RMS level of the sample to the target level. Peaks louder than
+   * full scale are clipped on export.
+   */
+  OP1_NORMALIZE_RMS = 2
+};
+
+/**
+ * Options controlling how leading and trailing silence is trimmed.
+ *
+ * @see op1_trim_options_init
+ * @see op1_sample_trim
+ */
+typedef struct op1_trim_options {
+  /**
+   * The level under which audio is considered silent, in dB relative to full
+   * scale, before normalization. -60.0 by default.
+   */
+  float threshold_db;
+  /**
+   * How long to keep after the last frame above the threshold, in
+   * milliseconds, so that tails fade out naturally. 20.0 by default.
+   */
+  float hold_ms;
+  /**
+   * How long to keep before the first frame above the threshold, in
+   * milliseconds, so that attacks are not cut. 2.0 by default.
+   */
+  float pre_roll_ms;
+} op1_trim_options;
+
+/**
+ * Options controlling how a sample is decoded.
+ *
+ * @see op1_sample_options_init
+ * @see op1_sample_load_with_options
+ */
+typedef struct op1_sample_options {
+  /**
+   * One of `OP1_RESAMPLE_QUALITY`, `OP1_RESAMPLE_MEDIUM` by default.
+   */
+  int resample_quality;
+  /**
+   * One of `OP1_DOWNMIX`, `OP1_DOWNMIX_AVERAGE` by default.
+   */
+  int downmix;
+  /**
+   * One of `OP1_NORMALIZE`, `OP1_NORMALIZE_NONE` by default. The levels are
+   * measured while decoding, so this does not add a pass over the audio.
+   */
+  int normalize;
+  /**
+   * The level to normalize to, in dB relative to full scale, 0.0 by default.
+   */
+  float normalize_target_db;
+  /**
+   * Whether to trim the silence at the start and end of the sample, as
+   * `op1_sample_trim` does, 0 by default. It is done before normalizing.
+   */
+  int trim;
+  /**
+   * How to trim, if `trim` is set. The defaults of `op1_trim_options_init`.
+   */
+  op1_trim_options trim_options;
+} op1_sample_options;
+
+/**
+ * Fill in `op1_sample_options` with the default values.
+ *
+ * @param options The options to initialize, has to be non-null.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_options_init(op1_sample_options * options);
+
+/**
+ * Fill in `op1_trim_options` with the default values.
+ *
+ * @param options The options to initialize, has to be non-null.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_trim_options_init(op1_trim_options * options);
+
 /**
  * Load a sample from a file name. All the file type supported by libsndfile are
- * supported.
+ * supported. Regular files are mapped in memory and decoded in place, without
+ * an intermediate copy. Samples are converted to `OP1_SAMPLE_RATE`, with the default options.
  *
  * @param file_name A file name, has to be non-null.
  * @param output An opaque handle to an audio file.
@@ -99,7 +557,9 @@ int EMSCRIPTEN_KEEPALIVE op1_sample_load(const char * file_name, audio_file ** o
 
 /**
  * Load a sample from a buffer. All the file type supported by libsndfile are
- * supported.
+ * supported. The buffer is decoded in place and not copied, it only has to
+ * stay valid for the duration of the call. Samples are converted to
+ * `OP1_SAMPLE_RATE`, with the default options.
  *
  * @param data A buffer containing raw audio file data.
  * @param length The size of the buffer.
@@ -110,9 +570,152 @@ int EMSCRIPTEN_KEEPALIVE op1_sample_load(const char * file_name, audio_file ** o
 int EMSCRIPTEN_KEEPALIVE op1_sample_load_buffer(const uint8_t * data, size_t length, audio_file ** output);
 
 /**
- * Destroy a sample previously loaded with `op1_sample_load`.
+ * Load a sample from a file name, like `op1_sample_load`.
+ *
+ * @param file_name A file name, has to be non-null.
+ * @param options Options controlling the decoding, has to be non-null.
+ * @param output An opaque handle to an audio file.
+ *
+ * @see op1_sample_options_init
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_load_with_options(const char * file_name, const op1_sample_options * options, audio_file ** output);
+
+/**
+ * Load a sample from a buffer, like `op1_sample_load_buffer`.
+ *
+ * @param data A buffer containing raw audio file data.
+ * @param length The size of the buffer.
+ * @param options Options controlling the decoding, has to be non-null.
+ * @param output An opaque handle to an audio file.
+ *
+ * @see op1_sample_options_init
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_load_buffer_with_options(const uint8_t * data, size_t length, const op1_sample_options * options, audio_file ** output);
+
+/**
+ * Load many samples from file names, decoding them concurrently. Each file is
+ * loaded like with `op1_sample_load_with_options`, and a failure to load one
+ * file does not stop the others.
+ *
+ * @param file_names An array of `count` file names, has to be non-null.
+ * @param count The number of files to load.
+ * @param options Options controlling the decoding, has to be non-null.
+ * @param threads The maximum number of files decoded at once, 0 for one per
+ * core.
+ * @param outputs An array of `count` handles, filled with the samples, or
+ * NULL for the files that failed to load.
+ * @param results An array of `count` error codes, filled with the result of
+ * loading each file.
+ *
+ * @returns OP1_ERROR if any of the files failed to load, an error code in case
+ * of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_load_many(const char * const * file_names, size_t count, const op1_sample_options * options, unsigned threads, audio_file ** outputs, int * results);
+
+/**
+ * Load many samples from buffers, decoding them concurrently, like
+ * `op1_sample_load_many`.
+ *
+ * @param data An array of `count` buffers containing raw audio file data.
+ * @param lengths An array of `count` buffer sizes.
+ * @param count The number of buffers to load.
+ * @param options Options controlling the decoding, has to be non-null.
+ * @param threads The maximum number of buffers decoded at once, 0 for one per
+ * core.
+ * @param outputs An array of `count` handles, filled with the samples, or
+ * NULL for the buffers that failed to load.
+ * @param results An array of `count` error codes, filled with the result of
+ * loading each buffer.
+ *
+ * @returns OP1_ERROR if any of the buffers failed to load, an error code in
+ * case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_load_buffer_many(const uint8_t * const * data, const size_t * lengths, size_t count, const op1_sample_options * options, unsigned threads, audio_file ** outputs, int * results);
+
+/**
+ * Statistics of the decode cache, to pass to `op1_sample_cache_get_stats`.
+ */
+typedef struct op1_sample_cache_stats {
+  /**
+   * Loads answered from the cache.
+   */
+  uint64_t hits;
+  /**
+   * Loads that had to decode, while the cache was enabled.
+   */
+  uint64_t misses;
+  /**
+   * Samples dropped to stay within the budget.
+   */
+  uint64_t evictions;
+  /**
+   * Samples in the cache.
+   */
+  size_t entries;
+  /**
+   * Memory used by the samples in the cache, in bytes.
+   */
+  size_t bytes;
+} op1_sample_cache_stats;
+
+/**
+ * Enable the decode cache, shared by all the threads of the process, or change
+ * its budget. While it is enabled, loading a file or buffer whose content has
+ * already been decoded with the same options returns a copy of the decoded
+ * audio instead of decoding it again. Samples are found by a 128-bit digest
+ * of the content of the file, not by its name. The least recently used
+ * samples are dropped when the cache is over `budget_bytes`. Files that can't
+ * be mapped in memory are never cached. The cache is disabled by default.
+ *
+ * @param budget_bytes The memory the cache can use, 0 to disable it and free
+ * the samples it holds.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_cache_enable(size_t budget_bytes);
+
+/**
+ * Get the statistics of the decode cache, since it was last cleared.
+ *
+ * @param stats The statistics, has to be non-null.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_cache_get_stats(op1_sample_cache_stats * stats);
+
+/**
+ * Free the samples held by the decode cache and reset its statistics. The
+ * cache stays enabled.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_cache_clear(void);
+
+/**
+ * Take an additional reference to a sample. Samples are reference counted: a
+ * freshly loaded sample holds one reference, owned by the caller, each call to
+ * `op1_sample_retain` adds one, and each call to `op1_sample_destroy` drops
+ * one. The sample is freed when the last reference goes away.
+ *
+ * @param sample The sample to retain, has to be non-null.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_retain(audio_file * sample);
+
+/**
+ * Release a reference to a sample previously loaded with `op1_sample_load`, or
+ * retained with `op1_sample_retain`. `op1_drum` contexts the sample has been
+ * added to hold their own reference, so the sample can be destroyed as soon as
+ * it has been added: its audio stays alive until the last context using it is
+ * destroyed.
  *
  * @see op1_sample_load
+ * @see op1_sample_retain
  *
  * @param sample The sample to destroy, has to be non-null.
  *
@@ -121,16 +724,72 @@ int EMSCRIPTEN_KEEPALIVE op1_sample_load_buffer(const uint8_t * data, size_t len
 int EMSCRIPTEN_KEEPALIVE op1_sample_destroy(audio_file * sample);
 
 /**
- * Get raw data, as a buffer of int16_t representing the mono file.
+ * Get raw data, as a buffer of int16_t representing the mono file. Samples are
+ * stored as floats: this is a rounded copy, with the gain of
+ * `op1_sample_normalize` applied, valid until the next call, and modifying it
+ * does not change the sample.
  *
  * @param sample An opaque handle to an audio file, has to be non-null.
  * @param data A pointer to a valid int16_t*, set to the raw data.
  * @param frame_count Filled with the number of frames of this file.
  *
+ * @see op1_sample_get_float_data
+ *
  * @returns an error code in case of error, OP1_SUCCESS otherwise.
  */
 int EMSCRIPTEN_KEEPALIVE op1_sample_get_data(audio_file * sample, int16_t ** data, size_t * frame_count);
 
+/**
+ * Get the audio of the sample, as a buffer of floats in [-1.0, 1.0)
+ * representing the mono file. The buffer belongs to the sample, and can be
+ * modified in place: the sample is then dithered when exported. A gain set
+ * with `op1_sample_normalize` is applied to the buffer first.
+ *
+ * @param sample An opaque handle to an audio file, has to be non-null.
+ * @param data A pointer to a valid float*, set to the audio data.
+ * @param frame_count Filled with the number of frames of this file.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_get_float_data(audio_file * sample, float ** data, size_t * frame_count);
+
+/**
+ * Normalize a sample, so that its peak or RMS level is `target_db` dB relative
+ * to full scale. The levels are known from decoding, and the gain is only
+ * applied when the sample is quantized to 16-bit, so this is cheap and can be
+ * called again with other settings: it always applies to the sample as
+ * loaded, or as last modified through `op1_sample_get_float_data`. The gain
+ * applies to every `op1_drum` the sample is used by. Silent samples are left
+ * untouched.
+ *
+ * @param sample An opaque handle to an audio file, has to be non-null.
+ * @param mode One of `OP1_NORMALIZE`, `OP1_NORMALIZE_NONE` removes the gain.
+ * @param target_db The target level, in dB relative to full scale.
+ *
+ * @returns OP1_ARGUMENT_ERROR if `mode` is unknown, an error code in case of
+ * error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_normalize(audio_file * sample, int mode, float target_db);
+
+/**
+ * Trim the leading and trailing silence of a sample, so that it takes less of
+ * the 12 seconds a drum kit can hold. The audio is not copied: the sample is
+ * cropped, and its length, its data and the start and end markers computed
+ * by `op1_drum_write` only cover what is kept. Trimming always applies to the
+ * whole sample as loaded, so it can be called again with other options. A
+ * silent sample is left untouched. Like `op1_sample_normalize`, this changes
+ * the sample for every `op1_drum` it is used by.
+ *
+ * @param sample An opaque handle to an audio file, has to be non-null.
+ * @param options Options controlling the trimming, has to be non-null.
+ *
+ * @see op1_trim_options_init
+ *
+ * @returns OP1_ARGUMENT_ERROR if the options are invalid, an error code in
+ * case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_trim(audio_file * sample, const op1_trim_options * options);
+
 /**
  * Get the sample-rate of the file.
  *
@@ -150,6 +809,18 @@ int EMSCRIPTEN_KEEPALIVE op1_sample_get_rate(audio_file * sample, int * rate);
  */
 int EMSCRIPTEN_KEEPALIVE op1_sample_get_length(audio_file * sample, size_t * frame_count);
 
+/**
+ * Get what loading and processing this sample has cost so far. Samples of
+ * kits read with `op1_drum_load` account for the decoding of their audio,
+ * which happens the first time it is needed.
+ *
+ * @param sample An opaque handle to an audio file, has to be non-null.
+ * @param stats Filled with the statistics of the sample.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_sample_get_stats(audio_file * sample, op1_stats * stats);
+
 /** Initialize a new `op1_drum` context.
  *
  * @param ctx A pointer to a valid pointer to an `op1_drum`.
@@ -166,39 +837,158 @@ int EMSCRIPTEN_KEEPALIVE op1_drum_init(op1_drum ** ctx);
  */
 int EMSCRIPTEN_KEEPALIVE op1_drum_destroy(op1_drum * ctx);
 
-/** Write the final audio file to disk. If any of `op1_drum_set_start_times` or
+/** Make an `op1_drum` context as if it had just been initialized: release its
+ * samples, and set all its parameters and stats back to their defaults.
+ *
+ * It keeps the memory it has allocated, so that a context reused for kits of
+ * similar sizes doesn't allocate anymore once it has exported the largest of
+ * them with `op1_drum_write_into`, `op1_drum_write_stream` or
+ * `op1_drum_write_fd`. The samples sped up by `op1_drum_fit` reuse the memory
+ * of the previous kits too. Use it instead of destroying and initializing a
+ * context for each kit.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_reset(op1_drum * ctx);
+
+/** Read a drum kit made by an OP-1 or by this library into a new `op1_drum`
+ * context. The parameters of the kit are read right away, and its start and
+ * end times are converted back to frames. Its audio becomes the only sample of
+ * the context, and is decoded the first time it is needed: a kit that is
+ * written again with only its parameters changed is copied as is.
+ *
+ * @param file_name A string containing the file name of the drum kit.
+ * @param ctx A pointer to a pointer that will be set to the new context.
+ *
+ * @see op1_drum_get_sample
+ *
+ * @returns OP1_IO_ERROR if the file could not be read, OP1_ERROR if it is not
+ * an OP-1 drum kit, an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_load(const char * file_name, op1_drum ** ctx);
+
+/** Read a drum kit from memory, like `op1_drum_load`. The audio is copied,
+ * `data` can be freed when this returns.
+ *
+ * @param data A pointer to the drum kit file.
+ * @param length The length of `data`, in bytes.
+ * @param ctx A pointer to a pointer that will be set to the new context.
+ *
+ * @returns OP1_ERROR if `data` is not an OP-1 drum kit, an error code in case
+ * of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_load_buffer(const uint8_t * data, size_t length, op1_drum ** ctx);
+
+/** Write the final audio file to disk. Drum kits longer than
+ * `OP1_DRUM_MAX_FRAMES`, or with start or end times past what the OP-1
+ * accepts, are rejected with OP1_OVER_BUDGET by all the write functions, see
+ * `op1_drum_fit`. If any of `op1_drum_set_start_times` or
  * `op1_drum_set_end_times` have been called with array that are not all zeros,
  * start and end times will be computed and will be the start and end of each
- * sample, with exactly one sample in between.
+ * sample, with exactly one sample in between. The file is streamed to disk,
+ * like with `op1_drum_write_stream`, and removed if writing fails.
  *
  * @param ctx A pointer to a valid `op1_drum`.
  * @param file_name A string containing the file name of the file to be written.
  *
- * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ * @returns OP1_IO_ERROR if the file could not be written, an error code in
+ * case of error, OP1_SUCCESS otherwise.
  */
 int EMSCRIPTEN_KEEPALIVE op1_drum_write(op1_drum * ctx, const char * file_name);
 
 /** Write the final audio file to a buffer. If any of `op1_drum_set_start_times`
  * or `op1_drum_set_end_times` have been called with array that are not all
  * zeros, start and end times will be computed and will be the start and end of
- * each sample, with exactly one sample in between.
+ * each sample, with exactly one sample in between. The encoded audio is kept
+ * by the context: exporting again after only changing parameters (pitches,
+ * volumes, effect...) copies it instead of encoding it again, with any of
+ * the write functions, as long as no sample has been given out with
+ * `op1_sample_get_float_data`. Only this function and `op1_drum_write_into`
+ * keep it: the streaming functions use it when it is there, but otherwise
+ * encode chunk by chunk, so that their memory stays bounded.
  *
  * @param ctx A pointer to a valid `op1_drum`.
- * @param output A pointer to an array containing the output data.
+ * @param output A pointer to an array containing the output data, to free
+ * with `op1_drum_free_buffer`.
  * @param length Filled in with the length of the array.
  *
  * @returns an error code in case of error, OP1_SUCCESS otherwise.
  */
 int EMSCRIPTEN_KEEPALIVE op1_drum_write_buffer(op1_drum * ctx, uint8_t ** output, size_t * length);
 
-/** Add a sample to an `op1_drum` context.
+/** Free a buffer returned by `op1_drum_write_buffer`.
+ *
+ * @param buffer The buffer.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_free_buffer(uint8_t * buffer);
+
+/** Write the final audio file to a callback, as it is produced: the header and
+ * JSON chunk first, then the audio data in chunks of bounded size. Start and
+ * end times are computed like in `op1_drum_write_buffer`.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param callback A function called with each chunk of the output file.
+ * @param user_data An opaque pointer passed back to `callback`.
+ *
+ * @returns OP1_IO_ERROR if `callback` failed, an error code in case of error,
+ * OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_write_stream(op1_drum * ctx, op1_write_callback callback, void * user_data);
+
+/** Write the final audio file to a file descriptor, like
+ * `op1_drum_write_stream`.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param fd A file descriptor open for writing. It is not closed.
+ *
+ * @returns OP1_IO_ERROR if writing failed, an error code in case of error,
+ * OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_write_fd(op1_drum * ctx, int fd);
+
+/** Compute the size, in bytes, of the final audio file, as it would be written
+ * by `op1_drum_write_into` or `op1_drum_write_buffer`.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param length Filled in with the size of the final audio file.
+ *
+ * @see op1_drum_write_into
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_output_size(op1_drum * ctx, size_t * length);
+
+/** Write the final audio file to a buffer owned by the caller. Start and end
+ * times are computed like in `op1_drum_write_buffer`.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param output A buffer that receives the output data.
+ * @param capacity The size of `output`, that has to be at least the size
+ * returned by `op1_drum_get_output_size`.
+ *
+ * @see op1_drum_get_output_size
+ *
+ * @returns OP1_BUFFER_TOO_SMALL if `output` can't hold the file, an error code
+ * in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_write_into(op1_drum * ctx, uint8_t * output, size_t capacity);
+
+/** Add a sample to an `op1_drum` context. The audio data is not copied: the
+ * context takes a reference to the sample, so the same sample can be added to
+ * any number of contexts. Modifications made to the sample data afterwards are
+ * seen by all the contexts using it.
  *
  * @param ctx A pointer to a valid `op1_drum`.
  * @param file A pointer to a valid `audio_file`.
  *
  * @see op1_sample_load
  *
- * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ * @returns OP1_ARGUMENT_ERROR if the kit already has 24 samples, an error code
+ * in case of error, OP1_SUCCESS otherwise.
  */
 int EMSCRIPTEN_KEEPALIVE op1_drum_add_sample(op1_drum * ctx, audio_file * file);
 /**
@@ -341,6 +1131,234 @@ int EMSCRIPTEN_KEEPALIVE op1_drum_set_start_times(op1_drum * ctx, int start_time
  */
 int EMSCRIPTEN_KEEPALIVE op1_drum_set_end_times(op1_drum * ctx, int end_times[24]);
 
+/**
+ * Set how the audio is quantized to 16-bit when the drum kit is written.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param dither One of `OP1_DITHER`, `OP1_DITHER_TPDF` by default.
+ *
+ * @see OP1_DITHER
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_set_dither(op1_drum * ctx, int dither);
+
+/**
+ * Get the number of samples of this drum kit.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param count Filled with the number of samples.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_sample_count(op1_drum * ctx, size_t * count);
+
+/**
+ * Get a sample of this drum kit, in the order they were added. The context
+ * keeps its reference: call `op1_sample_retain` to use the sample after the
+ * context is destroyed.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param index The index of the sample, less than the sample count.
+ * @param sample Set to the sample.
+ *
+ * @returns OP1_ARGUMENT_ERROR if `index` is out of range, an error code in
+ * case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_sample(op1_drum * ctx, size_t index, audio_file ** sample);
+
+/**
+ * Get the effect of this drum kit.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param fx Set to a string that lives as long as the program.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_fx(op1_drum * ctx, const char ** fx);
+
+/**
+ * Get wether the effect is active by default.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param active Set to 0 for inactive, 1 for active.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_fx_active(op1_drum * ctx, int * active);
+
+/**
+ * Get the effect parameters.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param params An array of 8 integers, filled with the parameters.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_fx_params(op1_drum * ctx, int params[8]);
+
+/**
+ * Get the LFO type of this drum kit.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param lfo Set to a string that lives as long as the program.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_lfo(op1_drum * ctx, const char ** lfo);
+
+/**
+ * Get wether the LFO is active by default.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param active Set to 0 for inactive, 1 for active.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_lfo_active(op1_drum * ctx, int * active);
+
+/**
+ * Get the LFO parameters.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param params An array of 8 integers, filled with the parameters.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_lfo_params(op1_drum * ctx, int params[8]);
+
+/**
+ * Get the play-mode of each sample.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param params An array of 24 integers, filled with values of `OP1_PLAYMODE`.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_playmode(op1_drum * ctx, int params[24]);
+
+/**
+ * Get the playback direction of each sample.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param params An array of 24 integers, filled with values of
+ * `OP1_PLAYBACK_DIRECTION`.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_playback_direction(op1_drum * ctx, int params[24]);
+
+/**
+ * Get the enveloppe of this drum kit.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param enveloppe An array of 8 integers, filled with the enveloppe.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_enveloppe(op1_drum * ctx, int enveloppe[8]);
+
+/**
+ * Get the pitch of each sample.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param pitches An array of 24 integers, filled with the pitches.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_pitches(op1_drum * ctx, int pitches[24]);
+
+/**
+ * Get the volume of each sample.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param volumes An array of 24 integers, filled with the volumes.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_volumes(op1_drum * ctx, int volumes[24]);
+
+/**
+ * Get the start time of each sample, all zeros unless they have been set or
+ * read from a file.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param start_times An array of 24 integers, filled with start times, in
+ * frames.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_start_times(op1_drum * ctx, int start_times[24]);
+
+/**
+ * Get the end time of each sample, all zeros unless they have been set or read
+ * from a file.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param end_times An array of 24 integers, filled with end times, in frames.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_end_times(op1_drum * ctx, int end_times[24]);
+
+/** Get what reading, fitting and exporting this kit has cost so far. The
+ * loading of its samples is accounted on each sample.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param stats Filled with the statistics of the kit.
+ *
+ * @returns an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_stats(op1_drum * ctx, op1_stats * stats);
+
+/**
+ * Get the 24 slices of a drum kit read with `op1_drum_load`, from its start and
+ * end times. The slices point into the audio of the file, nothing is decoded
+ * or copied: changes made to the sample afterwards are not seen.
+ *
+ * @param ctx A pointer to a valid `op1_drum`, read with `op1_drum_load` or
+ * `op1_drum_load_buffer`.
+ * @param slices An array of 24 slices, filled with a view of each slot.
+ *
+ * @returns OP1_ERROR if the context was not read from a file or has had
+ * samples added, an error code in case of error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_get_slices(op1_drum * ctx, op1_slice slices[24]);
+
+/**
+ * Write a slice of a drum kit read with `op1_drum_load` to a plain mono 16-bit
+ * AIFF file. The audio is written straight from the file the kit was read
+ * from.
+ *
+ * @param ctx A pointer to a valid `op1_drum`, read with `op1_drum_load` or
+ * `op1_drum_load_buffer`.
+ * @param index The slot to write, between 0 and 23.
+ * @param file_name A string containing the file name of the file to be written.
+ *
+ * @see op1_drum_get_slices
+ *
+ * @returns OP1_ARGUMENT_ERROR if `index` is out of range, OP1_IO_ERROR if the
+ * file could not be written, an error code in case of error, OP1_SUCCESS
+ * otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_write_slice(op1_drum * ctx, int index, const char * file_name);
+
+/**
+ * Make a drum kit fit in `OP1_DRUM_MAX_FRAMES`, if it is too long. This only
+ * changes how the samples are used by this context: the samples themselves are
+ * left untouched. Each call starts over from the full samples, so it can be
+ * called again after adding samples or with another policy. A kit that
+ * already fits is written as is.
+ *
+ * @param ctx A pointer to a valid `op1_drum`.
+ * @param policy One of `OP1_FIT_POLICY`.
+ * @param report Filled in with the changes made to each slot, can be null.
+ *
+ * @returns OP1_ARGUMENT_ERROR if `policy` is unknown, an error code in case of
+ * error, OP1_SUCCESS otherwise.
+ */
+int EMSCRIPTEN_KEEPALIVE op1_drum_fit(op1_drum * ctx, int policy, op1_fit_report * report);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,901 @@
+#include "sndfile.h"
+#include "cli.hpp"
+#include "json.hpp"
+#include "op1.h"
+#include "op1_aiff.h"
+#include "op1_appl.h"
+#include "op1_dsp.h"
+#include "op1_resample.h"
+#include "op1_thread_pool.h"
+#include <sys/resource.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using json = nlohmann::json;
+
+// Every allocation made with `new` by the benchmarks, and by the library
+// through its allocator, to report how many each operation makes. Allocations
+// made by libsndfile with `malloc` are not counted.
+atomic<uint64_t> g_allocations(0);
+
+// None of those are inlined, so that the compiler sees `new` paired with
+// `delete`, and not `malloc` with `delete` or `new` with `free`.
+__attribute__((noinline)) void * operator new(size_t size)
+{
+  g_allocations.fetch_add(1, memory_order_relaxed);
+  void * p = malloc(size ? size : 1);
+  if (!p) {
+    throw bad_alloc();
+  }
+  return p;
+}
+
+__attribute__((noinline)) void * operator new(size_t size,
+                                               const nothrow_t &) noexcept
+{
+  g_allocations.fetch_add(1, memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void operator delete(void * p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void * p,
+                                               const nothrow_t &) noexcept
+{
+  free(p);
+}
+
+namespace {
+void * counting_allocate(size_t size, void * user_data)
+{
+  g_allocations.fetch_add(1, memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+void counting_deallocate(void * p, void * user_data)
+{
+  free(p);
+}
+
+// The results of all the benchmarks, written out with -json.
+json g_results = json::array();
+
+// Record a result, `frames` and `bytes` being what one run processes.
+// Throughputs that don't apply are left out.
+void record(json result, double seconds, double frames, double bytes,
+            uint64_t allocations)
+{
+  result["seconds"] = seconds;
+  if (frames) {
+    result["frames_per_second"] = frames / seconds;
+  }
+  if (bytes) {
+    result["mb_per_second"] = bytes / seconds / (1024.0 * 1024.0);
+  }
+  result["allocations"] = allocations;
+  g_results.push_back(result);
+}
+struct quality_name
+{
+  int quality;
+  const char * name;
+};
+
+const quality_name QUALITIES[] = {
+  { OP1_RESAMPLE_FAST, "fast" },
+  { OP1_RESAMPLE_MEDIUM, "medium" },
+  { OP1_RESAMPLE_BEST, "best" }
+};
+
+vector<float> sine(uint32_t rate, double seconds, double frequency = 440.0)
+{
+  vector<float> signal(rate * seconds);
+  for (size_t i = 0; i < signal.size(); i++) {
+    signal[i] = 0.5 * sin(2.0 * 3.14159265358979323846 * frequency * i / rate);
+  }
+  return signal;
+}
+
+// White noise, the same for a given seed.
+vector<float> noise(uint32_t rate, double seconds, unsigned seed)
+{
+  mt19937 generator(seed);
+  uniform_real_distribution<float> distribution(-0.5f, 0.5f);
+  vector<float> signal(rate * seconds);
+  for (size_t i = 0; i < signal.size(); i++) {
+    signal[i] = distribution(generator);
+  }
+  return signal;
+}
+
+// Run `fn` `iterations` times, and return the fastest run, in seconds. If
+// `allocations` is not null, it is set to the number of allocations of a run.
+template<typename F>
+double best_of(int iterations, F fn, uint64_t * allocations = nullptr)
+{
+  double best = INFINITY;
+  if (allocations) {
+    *allocations = 0;
+  }
+  for (int i = 0; i < iterations; i++) {
+    uint64_t before = g_allocations.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+    fn();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    best = min(best, elapsed.count());
+    if (allocations) {
+      *allocations = g_allocations.load(memory_order_relaxed) - before;
+    }
+  }
+  return best;
+}
+
+void bench_resample(double seconds, int iterations)
+{
+  const uint32_t rates[] = { 22050, 48000, 96000 };
+
+  for (uint32_t rate : rates) {
+    vector<float> input = sine(rate, seconds);
+    op1_vector<float> output;
+
+    for (const quality_name & q : QUALITIES) {
+      uint64_t allocations;
+      double elapsed = best_of(iterations, [&]() {
+        resample(input.data(), input.size(), rate, OP1_SAMPLE_RATE, q.quality, output);
+      }, &allocations);
+      printf("resample %-6s %6u -> %u: %12.0f frames/s\n", q.name, rate,
+             OP1_SAMPLE_RATE, input.size() / elapsed);
+      record({ { "benchmark", "resample" }, { "quality", q.name },
+               { "rate", rate } },
+             elapsed, input.size(), 0, allocations);
+    }
+  }
+}
+
+// Compares the 16-bit export path, that only converted to big-endian, to the
+// float path, that quantizes with dither first.
+void bench_quantize(double seconds, int iterations)
+{
+  vector<float> input = sine(OP1_SAMPLE_RATE, seconds);
+  vector<int16_t> pcm(input.size());
+  vector<uint8_t> output(input.size() * sizeof(int16_t));
+  dsp_float_to_int16(input.data(), pcm.data(), pcm.size(), 1.0f);
+
+  double baseline = best_of(iterations, [&]() {
+    aiff_write_frames(output.data(), pcm.data(), pcm.size());
+  });
+  printf("export int16:  %12.0f frames/s\n", input.size() / baseline);
+  record({ { "benchmark", "quantize" }, { "dither", "int16" } }, baseline,
+         input.size(), 0, 0);
+
+  const size_t BLOCK = 1024;
+  const char * names[] = { "none", "tpdf", "shaped" };
+  for (int dither = OP1_DITHER_NONE; dither <= OP1_DITHER_SHAPED; dither++) {
+    double elapsed = best_of(iterations, [&]() {
+      dither_state state;
+      dsp_dither_init(&state, 0);
+      int16_t block[BLOCK];
+      uint8_t * out = output.data();
+      for (size_t i = 0; i < input.size(); i += BLOCK) {
+        size_t n = min(BLOCK, input.size() - i);
+        if (dither == OP1_DITHER_NONE) {
+          dsp_float_to_int16(input.data() + i, block, n, 1.0f);
+        } else if (dither == OP1_DITHER_TPDF) {
+          dsp_quantize_tpdf(input.data() + i, block, n, 1.0f, &state);
+        } else {
+          dsp_quantize_shaped(input.data() + i, block, n, 1.0f, &state);
+        }
+        out = aiff_write_frames(out, block, n);
+      }
+    });
+    printf("export float %-6s %12.0f frames/s (%.2fx the int16 path)\n",
+           names[dither], input.size() / elapsed, elapsed / baseline);
+    record({ { "benchmark", "quantize" }, { "dither", names[dither] } },
+           elapsed, input.size(), 0, 0);
+  }
+}
+
+// The normalization op1-drum used to do on 16-bit samples, two scalar passes.
+void normalize_int16_scalar(int16_t * samples, size_t sample_count)
+{
+  int max_abs = 0;
+  for (size_t i = 0; i < sample_count; i++) {
+    max_abs = max(abs(samples[i]), max_abs);
+  }
+  if (!max_abs) {
+    return;
+  }
+  float gain = 32768.0f / max_abs;
+  for (size_t i = 0; i < sample_count; i++) {
+    samples[i] = max(-32768.0f, min(32767.0f, samples[i] * gain));
+  }
+}
+
+// The same on float samples, what op1-drum did before it used the library.
+void normalize_float_scalar(float * samples, size_t sample_count)
+{
+  float max_abs = 0;
+  for (size_t i = 0; i < sample_count; i++) {
+    max_abs = max(fabsf(samples[i]), max_abs);
+  }
+  if (max_abs == 0) {
+    return;
+  }
+  float gain = 1.0 / max_abs;
+  for (size_t i = 0; i < sample_count; i++) {
+    samples[i] = samples[i] * gain;
+  }
+}
+
+// Compares the scalar normalization passes to the vectorized kernels. The
+// library only measures the levels, fused with decoding, and applies the gain
+// when quantizing: "levels" is all a normalized load adds.
+void bench_normalize(double seconds, int iterations)
+{
+  vector<float> input = sine(OP1_SAMPLE_RATE, seconds);
+  vector<int16_t> pcm(input.size());
+  vector<float> work(input.size());
+  dsp_float_to_int16(input.data(), pcm.data(), pcm.size(), 1.0f);
+  vector<int16_t> pcm_work(pcm.size());
+
+  double baseline = best_of(iterations, [&]() {
+    pcm_work = pcm;
+    normalize_int16_scalar(pcm_work.data(), pcm_work.size());
+  });
+  printf("normalize int16 scalar: %12.0f frames/s\n", input.size() / baseline);
+  record({ { "benchmark", "normalize" }, { "variant", "int16 scalar" } },
+         baseline, input.size(), 0, 0);
+
+  double elapsed = best_of(iterations, [&]() {
+    work = input;
+    normalize_float_scalar(work.data(), work.size());
+  });
+  printf("normalize float scalar: %12.0f frames/s (%.2fx faster)\n",
+         input.size() / elapsed, baseline / elapsed);
+  record({ { "benchmark", "normalize" }, { "variant", "float scalar" } },
+         elapsed, input.size(), 0, 0);
+
+  elapsed = best_of(iterations, [&]() {
+    work = input;
+    float peak = 0.0f;
+    double energy = 0.0;
+    dsp_levels(work.data(), work.size(), &peak, &energy);
+    dsp_apply_gain(work.data(), work.size(), 1.0f / peak);
+  });
+  printf("normalize float simd:   %12.0f frames/s (%.2fx faster)\n",
+         input.size() / elapsed, baseline / elapsed);
+  record({ { "benchmark", "normalize" }, { "variant", "float simd" } },
+         elapsed, input.size(), 0, 0);
+
+  elapsed = best_of(iterations, [&]() {
+    work = input;
+    float peak = 0.0f;
+    double energy = 0.0;
+    dsp_levels(work.data(), work.size(), &peak, &energy);
+  });
+  printf("normalize levels only:  %12.0f frames/s (%.2fx faster)\n",
+         input.size() / elapsed, baseline / elapsed);
+  record({ { "benchmark", "normalize" }, { "variant", "levels only" } },
+         elapsed, input.size(), 0, 0);
+}
+
+// How the APPL document used to be made, through a DOM.
+string appl_with_dom(const drum_appl & appl)
+{
+  json j;
+
+  j["drum_version"] = 1;
+  j["type"] = "drum";
+  j["name"] = "user";
+  j["octave"] = 0;
+  j["pitch"] = appl.pitches;
+  j["start"] = appl.start;
+  j["end"] = appl.end;
+  j["playmode"] = appl.playmode;
+  j["reverse"] = appl.playback_direction;
+  j["volume"] = appl.volumes;
+  j["dyna_env"] = appl.enveloppe;
+  j["fx_active"] = appl.fx_active;
+  j["fx_type"] = appl.fx_type;
+  j["fx_params"] = appl.fx_params;
+  j["lfo_active"] = appl.lfo_active;
+  j["lfo_type"] = appl.lfo_type;
+  j["lfo_params"] = appl.lfo_params;
+
+  return j.dump();
+}
+
+// Compares the DOM to the fixed-layout serializer, on a kit with 24 slots,
+// and checks that they give the same document.
+void bench_appl(int iterations)
+{
+  const int DOCUMENTS = 100000;
+  drum_appl appl;
+  uint64_t time = 0;
+
+  for (size_t i = 0; i < 24; i++) {
+    appl.pitches[i] = i * 512 - 6144;
+    appl.playmode[i] = OP1_PLAYMODE_ONE_SHOT;
+    appl.playback_direction[i] = OP1_PLAYBACK_FORWARD;
+    appl.volumes[i] = OP1_VOLUME_FLAT;
+    appl.start[i] = time;
+    time += 4058 * 22050;
+    appl.end[i] = time;
+  }
+  for (size_t i = 0; i < 8; i++) {
+    appl.enveloppe[i] = i * 1024;
+    appl.fx_params[i] = 8000;
+    appl.lfo_params[i] = 16000 - i;
+  }
+  appl.fx_active = 1;
+  appl.fx_type = "spring";
+  appl.lfo_active = 0;
+  appl.lfo_type = "tremolo";
+
+  char out[DRUM_APPL_CAPACITY];
+  size_t length = appl_write_drum(appl, out);
+  string expected = appl_with_dom(appl);
+  if (expected != string(out, length)) {
+    printf("appl: the serializer and the DOM differ!\n");
+  }
+
+  size_t total = 0;
+  uint64_t allocations;
+  double baseline = best_of(iterations, [&]() {
+    for (int i = 0; i < DOCUMENTS; i++) {
+      total += appl_with_dom(appl).size();
+    }
+  }, &allocations);
+  printf("appl dom:        %12.0f documents/s\n", DOCUMENTS / baseline);
+  record({ { "benchmark", "appl" }, { "variant", "dom" },
+           { "documents_per_second", DOCUMENTS / baseline } },
+         baseline, 0, double(length) * DOCUMENTS, allocations / DOCUMENTS);
+
+  double elapsed = best_of(iterations, [&]() {
+    for (int i = 0; i < DOCUMENTS; i++) {
+      total += appl_write_drum(appl, out);
+    }
+  }, &allocations);
+  printf("appl serializer: %12.0f documents/s (%.2fx faster)\n",
+         DOCUMENTS / elapsed, baseline / elapsed);
+  record({ { "benchmark", "appl" }, { "variant", "serializer" },
+           { "documents_per_second", DOCUMENTS / elapsed } },
+         elapsed, 0, double(length) * DOCUMENTS, allocations / DOCUMENTS);
+
+  // keep the loops from being optimized out
+  if (!total) {
+    printf("\n");
+  }
+}
+
+struct format_name
+{
+  int format;
+  const char * name;
+};
+
+const format_name FORMATS[] = {
+  { SF_FORMAT_WAV | SF_FORMAT_PCM_16, "wav" },
+  { SF_FORMAT_AIFF | SF_FORMAT_PCM_16, "aiff" },
+  { SF_FORMAT_FLAC | SF_FORMAT_PCM_16, "flac" }
+};
+
+// A file generated for the benchmarks, and its contents.
+struct fixture
+{
+  json description;
+  string path;
+  size_t frames;
+  vector<uint8_t> contents;
+};
+
+// Write `seconds` of sine or noise to `path`, one signal per channel.
+bool write_fixture(const string & path, int format, int rate, int channels,
+                   bool is_noise, double seconds, fixture * f)
+{
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.samplerate = rate;
+  info.channels = channels;
+  info.format = format;
+
+  vector<vector<float>> signals;
+  for (int c = 0; c < channels; c++) {
+    signals.push_back(is_noise ? noise(rate, seconds, c)
+                               : sine(rate, seconds, 440.0 * (c + 1)));
+  }
+  vector<float> interleaved(signals[0].size() * channels);
+  for (size_t i = 0; i < signals[0].size(); i++) {
+    for (int c = 0; c < channels; c++) {
+      interleaved[i * channels + c] = signals[c][i];
+    }
+  }
+
+  SNDFILE * file = sf_open(path.c_str(), SFM_WRITE, &info);
+  if (!file) {
+    return false;
+  }
+  sf_writef_float(file, interleaved.data(), signals[0].size());
+  if (sf_close(file)) {
+    return false;
+  }
+
+  ifstream in(path, ios::binary);
+  f->contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  f->path = path;
+  f->frames = signals[0].size();
+
+  return !f->contents.empty();
+}
+
+// Generate the fixtures in `directory`: sine and noise, in all the formats,
+// mono and stereo, at rates that need converting or not.
+vector<fixture> make_fixtures(const string & directory, double seconds)
+{
+  const int rates[] = { 22050, 44100, 48000 };
+  vector<fixture> fixtures;
+
+  for (const format_name & format : FORMATS) {
+    for (int channels = 1; channels <= 2; channels++) {
+      for (int rate : rates) {
+        for (int is_noise = 0; is_noise <= 1; is_noise++) {
+          fixture f;
+          f.description = { { "format", format.name },
+                            { "channels", channels }, { "rate", rate },
+                            { "signal", is_noise ? "noise" : "sine" } };
+          string path = directory + "/" + format.name + "-" +
+                        to_string(channels) + "-" + to_string(rate) + "-" +
+                        (is_noise ? "noise" : "sine") + "." + format.name;
+          if (!write_fixture(path, format.format, rate, channels, is_noise,
+                             seconds, &f)) {
+            FATAL("Could not write the fixtures.");
+          }
+          fixtures.push_back(f);
+        }
+      }
+    }
+  }
+
+  return fixtures;
+}
+
+// Loads each fixture from its file and from memory, with the default options.
+void bench_load(const vector<fixture> & fixtures, int iterations)
+{
+  for (const fixture & f : fixtures) {
+    string name = f.description["format"].get<string>() + " " +
+                  f.description["channels"].dump() + "ch " +
+                  f.description["rate"].dump() + " " +
+                  f.description["signal"].get<string>();
+    uint64_t allocations;
+    double elapsed = best_of(iterations, [&]() {
+      audio_file * sample;
+      if (op1_sample_load(f.path.c_str(), &sample)) {
+        FATAL("Could not load a fixture.");
+      }
+      op1_sample_destroy(sample);
+    }, &allocations);
+    printf("load %-26s %12.0f frames/s %8.1f MB/s %6" PRIu64 " allocations\n",
+           name.c_str(), f.frames / elapsed,
+           f.contents.size() / elapsed / (1024.0 * 1024.0), allocations);
+    json result = f.description;
+    result["benchmark"] = "op1_sample_load";
+    record(result, elapsed, f.frames, f.contents.size(), allocations);
+
+    elapsed = best_of(iterations, [&]() {
+      audio_file * sample;
+      if (op1_sample_load_buffer(f.contents.data(), f.contents.size(),
+                                 &sample)) {
+        FATAL("Could not load a fixture.");
+      }
+      op1_sample_destroy(sample);
+    }, &allocations);
+    printf("load buffer %-19s %12.0f frames/s %8.1f MB/s %6" PRIu64
+           " allocations\n", name.c_str(), f.frames / elapsed,
+           f.contents.size() / elapsed / (1024.0 * 1024.0), allocations);
+    result["benchmark"] = "op1_sample_load_buffer";
+    record(result, elapsed, f.frames, f.contents.size(), allocations);
+  }
+}
+
+// A kit of `slots` samples loaded from `f`, that has not been exported yet.
+op1_drum * make_kit(const fixture & f, size_t slots)
+{
+  op1_drum * drum;
+  op1_drum_init(&drum);
+  for (size_t i = 0; i < slots; i++) {
+    audio_file * sample;
+    if (op1_sample_load_buffer(f.contents.data(), f.contents.size(),
+                               &sample)) {
+      FATAL("Could not load a fixture.");
+    }
+    op1_drum_add_sample(drum, sample);
+    op1_sample_destroy(sample);
+  }
+  return drum;
+}
+
+// Exports kits of 1 to 24 slots to memory and to a file. A kit that has
+// already been exported reuses its encoded audio, so each run of the "cold"
+// benchmarks uses a new kit, and "cached" exports the same kit again.
+void bench_export(const string & directory, int iterations)
+{
+  const size_t slot_counts[] = { 1, 6, 12, 24 };
+  // short enough for 24 slots to fit on the OP-1
+  fixture slot;
+  slot.description = json::object();
+  if (!write_fixture(directory + "/slot.wav", SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+                     OP1_SAMPLE_RATE, 1, false, 0.45, &slot)) {
+    FATAL("Could not write the fixtures.");
+  }
+  string output = directory + "/kit.aif";
+
+  for (size_t slots : slot_counts) {
+    size_t frames = slot.frames * slots;
+    // set by the first export, the size of the kit
+    size_t bytes = 0;
+
+    // timed without building the kit
+    auto timed = [&](bool cached, bool to_file, uint64_t * allocations) {
+      double best = INFINITY;
+      op1_drum * drum = make_kit(slot, slots);
+      *allocations = 0;
+      for (int i = 0; i < iterations; i++) {
+        if (!cached) {
+          op1_drum_destroy(drum);
+          drum = make_kit(slot, slots);
+        }
+        double elapsed = best_of(1, [&]() {
+          if (to_file) {
+            if (op1_drum_write(drum, output.c_str())) {
+              FATAL("Could not export a kit.");
+            }
+          } else {
+            uint8_t * data;
+            if (op1_drum_write_buffer(drum, &data, &bytes)) {
+              FATAL("Could not export a kit.");
+            }
+            op1_drum_free_buffer(data);
+          }
+        }, allocations);
+        best = min(best, elapsed);
+      }
+      op1_drum_destroy(drum);
+      return best;
+    };
+
+    const char * names[] = { "op1_drum_write_buffer", "op1_drum_write" };
+    for (int to_file = 0; to_file <= 1; to_file++) {
+      for (int cached = 0; cached <= 1; cached++) {
+        uint64_t allocations;
+        double elapsed = timed(cached, to_file, &allocations);
+        printf("%-21s %2zu slots %-6s %12.0f frames/s %8.1f MB/s %6" PRIu64
+               " allocations\n", names[to_file], slots,
+               cached ? "cached" : "cold", frames / elapsed,
+               bytes / elapsed / (1024.0 * 1024.0), allocations);
+        record({ { "benchmark", names[to_file] }, { "slots", slots },
+                 { "cached", bool(cached) } },
+               elapsed, frames, bytes, allocations);
+      }
+    }
+
+    // one context for all the kits, as a server would: reset it, add samples
+    // that are already loaded, and export into the same buffer. Once it has
+    // exported a kit this size, it should not allocate anymore.
+    vector<audio_file *> samples(slots);
+    for (size_t i = 0; i < slots; i++) {
+      if (op1_sample_load_buffer(slot.contents.data(), slot.contents.size(),
+                                 &samples[i])) {
+        FATAL("Could not load a fixture.");
+      }
+    }
+    op1_drum * drum;
+    op1_drum_init(&drum);
+    vector<uint8_t> kit(bytes);
+    auto reuse = [&]() {
+      op1_drum_reset(drum);
+      for (size_t i = 0; i < slots; i++) {
+        op1_drum_add_sample(drum, samples[i]);
+      }
+      if (op1_drum_write_into(drum, kit.data(), kit.size())) {
+        FATAL("Could not export a kit.");
+      }
+    };
+    reuse();
+    uint64_t allocations;
+    double elapsed = best_of(iterations, reuse, &allocations);
+    if (allocations) {
+      fprintf(stderr, "Warning: reusing a context for %zu slots allocates.\n",
+              slots);
+    }
+    printf("%-21s %2zu slots %-6s %12.0f frames/s %8.1f MB/s %6" PRIu64
+           " allocations\n", "op1_drum_reset", slots, "reused",
+           frames / elapsed, bytes / elapsed / (1024.0 * 1024.0), allocations);
+    record({ { "benchmark", "op1_drum_reset" }, { "slots", slots } },
+           elapsed, frames, bytes, allocations);
+    op1_drum_destroy(drum);
+    for (size_t i = 0; i < slots; i++) {
+      op1_sample_destroy(samples[i]);
+    }
+  }
+}
+
+// Kits built by the stress test differ by their variant.
+const size_t STRESS_VARIANTS = 8;
+
+const char * STRESS_FX[] = {
+  "cwo", "delay", "grid", "nitro", "phone", "punch", "spring"
+};
+
+// Messages received by `count_message`.
+atomic<uint64_t> g_messages(0);
+
+void count_message(int level, const char * file, int line,
+                   const char * message, void * user_data)
+{
+  g_messages.fetch_add(1, memory_order_relaxed);
+}
+
+// Build the kit of `variant` from `fixtures`, or from `shared` if it is not
+// empty: samples that other threads add to their kits at the same time.
+// Returns false if any step failed.
+bool build_stress_kit(size_t variant, const vector<fixture> & fixtures,
+                      const vector<audio_file *> & shared,
+                      vector<uint8_t> * output)
+{
+  size_t slots = 1 + variant * 3 % 24;
+  op1_drum * drum;
+  if (op1_drum_init(&drum)) {
+    return false;
+  }
+
+  bool ok = true;
+  for (size_t i = 0; ok && i < slots; i++) {
+    size_t which = (i + variant) % fixtures.size();
+    if (!shared.empty()) {
+      ok = !op1_drum_add_sample(drum, shared[which]);
+      continue;
+    }
+    const fixture & f = fixtures[which];
+    audio_file * sample;
+    // half from the files, half from memory, all through the decode cache
+    int rv = i % 2 ? op1_sample_load(f.path.c_str(), &sample)
+                   : op1_sample_load_buffer(f.contents.data(),
+                                            f.contents.size(), &sample);
+    ok = !rv && !op1_drum_add_sample(drum, sample);
+    if (!rv) {
+      op1_sample_destroy(sample);
+    }
+  }
+
+  int pitches[24];
+  for (size_t i = 0; i < 24; i++) {
+    pitches[i] = (variant * 24 + i) * 256 % 8192 - 4096;
+  }
+  ok = ok && !op1_drum_set_pitches(drum, pitches) &&
+       !op1_drum_set_fx(drum, STRESS_FX[variant % 7]) &&
+       !op1_drum_set_dither(drum, variant % 3);
+
+  uint8_t * data;
+  size_t length;
+  if (ok && !op1_drum_write_buffer(drum, &data, &length)) {
+    output->assign(data, data + length);
+    op1_drum_free_buffer(data);
+  } else {
+    ok = false;
+  }
+
+  op1_drum_destroy(drum);
+
+  return ok;
+}
+
+// Read `kit` back and export it again, which has to give the same file.
+bool round_trips(const vector<uint8_t> & kit)
+{
+  op1_drum * drum;
+  if (op1_drum_load_buffer(kit.data(), kit.size(), &drum)) {
+    return false;
+  }
+  uint8_t * data;
+  size_t length;
+  bool same = false;
+  if (!op1_drum_write_buffer(drum, &data, &length)) {
+    same = length == kit.size() && !memcmp(data, kit.data(), length);
+    op1_drum_free_buffer(data);
+  }
+  op1_drum_destroy(drum);
+  return same;
+}
+
+// Build `kits` kits on `threads` threads at once, with the decode cache and
+// the log callback on, and check that each is the same as when built alone.
+// Meant to be run under ThreadSanitizer. Returns the number of kits that
+// failed.
+size_t stress(const string & directory, size_t kits, unsigned threads)
+{
+  // short, and at rates that need converting, so that most of the work is
+  // loading and exporting
+  vector<fixture> fixtures;
+  const int rates[] = { 22050, 48000 };
+  for (int rate : rates) {
+    for (int is_noise = 0; is_noise <= 1; is_noise++) {
+      fixture f;
+      string path = directory + "/stress-" + to_string(rate) + "-" +
+                    to_string(is_noise) + ".wav";
+      if (!write_fixture(path, SF_FORMAT_WAV | SF_FORMAT_PCM_16, rate, 2,
+                         is_noise, 0.2, &f)) {
+        FATAL("Could not write the fixtures.");
+      }
+      fixtures.push_back(f);
+    }
+  }
+
+  op1_sample_cache_enable(64 * 1024 * 1024);
+  op1_set_log_callback(OP1_LOG_DEBUG, count_message, nullptr);
+
+  // what each variant gives when built alone
+  vector<vector<uint8_t>> expected(STRESS_VARIANTS);
+  vector<audio_file *> none;
+  for (size_t v = 0; v < STRESS_VARIANTS; v++) {
+    if (!build_stress_kit(v, fixtures, none, &expected[v])) {
+      FATAL("Could not build the reference kits.");
+    }
+  }
+
+  vector<audio_file *> shared(fixtures.size());
+  for (size_t i = 0; i < fixtures.size(); i++) {
+    if (op1_sample_load(fixtures[i].path.c_str(), &shared[i])) {
+      FATAL("Could not load a fixture.");
+    }
+  }
+
+  atomic<size_t> failures(0);
+  auto start = chrono::steady_clock::now();
+
+  parallel_for(kits, threads, [&](size_t i) {
+    size_t variant = i % STRESS_VARIANTS;
+    vector<uint8_t> kit;
+    bool ok = build_stress_kit(variant, fixtures, i % 2 ? shared : none,
+                               &kit) &&
+              kit == expected[variant] && (i % 4 || round_trips(kit));
+    if (!ok) {
+      failures.fetch_add(1, memory_order_relaxed);
+    }
+  });
+
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  op1_sample_cache_stats stats;
+  op1_sample_cache_get_stats(&stats);
+  printf("stress: %zu kits in %.2fs, %zu failed, %" PRIu64 " messages, %"
+         PRIu64 " decode cache hits\n", kits, elapsed.count(), failures.load(),
+         g_messages.load(), stats.hits);
+
+  for (size_t i = 0; i < shared.size(); i++) {
+    op1_sample_destroy(shared[i]);
+  }
+  for (const fixture & f : fixtures) {
+    unlink(f.path.c_str());
+  }
+  op1_set_log_callback(OP1_LOG_WARNING, nullptr, nullptr);
+  op1_sample_cache_enable(0);
+
+  return failures;
+}
+
+// Peak resident set size of the process, in kilobytes.
+long peak_rss_kb()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+}
+
+int main(int argc, const char ** argv) {
+  cli::Parser parser(argc, argv);
+
+  parser.help() << R"(op1-bench
+    Usage: op1-bench [options]
+
+    Runs the libop1 benchmarks on synthetic signals, and prints the results.
+    The audio files loaded by the benchmarks are generated in a temporary directory, and removed at the end.)";
+
+  auto seconds = parser.option("seconds")
+                       .alias("s")
+                       .description("Length of the synthetic signals, in seconds.")
+                       .defaultValue("10")
+                       .getValueAs<double>();
+
+  auto iterations = parser.option("iterations")
+                          .alias("i")
+                          .description("Number of runs of each benchmark, the fastest is reported.")
+                          .defaultValue("5")
+                          .getValueAs<int>();
+
+  auto json_path = parser.option("json")
+                         .description("Also write the results to this file, as a JSON document, to compare runs.")
+                         .getValue();
+
+  auto stress_kits = parser.option("stress")
+                           .description("Instead of the benchmarks, build this many kits at once and check them, to run under ThreadSanitizer.")
+                           .defaultValue("0")
+                           .getValueAs<unsigned>();
+
+  auto threads = parser.option("threads")
+                       .alias("t")
+                       .description("Number of kits built at once with -stress, 0 for one per core.")
+                       .defaultValue("0")
+                       .getValueAs<unsigned>();
+
+  if (parser.hasErrors()) {
+    return EXIT_FAILURE;
+  }
+
+  op1_allocator counting = { counting_allocate, counting_deallocate, nullptr };
+  op1_set_allocator(&counting);
+
+  const char * tmp = getenv("TMPDIR");
+  string directory = string(tmp ? tmp : "/tmp") + "/op1-bench-XXXXXX";
+  if (!mkdtemp(&directory[0])) {
+    FATAL("Could not create a directory for the fixtures.");
+  }
+
+  if (stress_kits) {
+    size_t failures = stress(directory, stress_kits, threads);
+    rmdir(directory.c_str());
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  vector<fixture> fixtures = make_fixtures(directory, seconds);
+
+  bench_resample(seconds, iterations);
+  bench_quantize(seconds, iterations);
+  bench_normalize(seconds, iterations);
+  bench_appl(iterations);
+  bench_load(fixtures, iterations);
+  bench_export(directory, iterations);
+
+  for (const fixture & f : fixtures) {
+    unlink(f.path.c_str());
+  }
+  unlink((directory + "/slot.wav").c_str());
+  unlink((directory + "/kit.aif").c_str());
+  rmdir(directory.c_str());
+
+  long rss = peak_rss_kb();
+  printf("peak rss: %ld kB\n", rss);
+
+  if (json_path) {
+    json report;
+    report["seconds"] = seconds;
+    report["iterations"] = iterations;
+    report["peak_rss_kb"] = rss;
+    report["results"] = g_results;
+    ofstream out(json_path);
+    out << report.dump(2) << "\n";
+    if (!out) {
+      FATAL("Could not write the results.");
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
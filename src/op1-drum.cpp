@@ -3,6 +3,13 @@
 
 #include "cli.hpp"
 #include "op1.h"
+#include "op1_thread_pool.h"
+#include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <cstdlib>
 #include <cmath>
@@ -10,18 +17,397 @@
 using namespace std;
 using json = nlohmann::json;
 
-void normalize_buffer(int16_t * samples, size_t sample_count)
+namespace {
+const char * QUALITIES[] = { "none", "fast", "medium", "best" };
+const char * DOWNMIXES[] = { "average", "left", "right", "mid", "max-energy" };
+// "none", then the names of `OP1_FIT_POLICY`, in order.
+const char * FITS[] = { "none", "truncate", "trim-silence", "compress" };
+
+// Index of `name` in `names`, or -1.
+template<size_t N>
+int find_name(const char * (&names)[N], const char * name)
+{
+  for (size_t i = 0; i < N; i++) {
+    if (!strcmp(name, names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Everything needed to build one drum kit. Empty arrays keep the defaults of
+// the library.
+struct kit
+{
+  string output;
+  vector<string> files;
+  op1_sample_options options;
+  // One of `FITS`.
+  int fit;
+  string fx_type;
+  bool fx_on;
+  vector<int> fx_params;
+  string lfo_type;
+  bool lfo_on;
+  vector<int> lfo_params;
+  vector<int> pitches;
+  vector<int> volumes;
+  vector<int> playmode;
+  vector<int> reverse;
+};
+
+// Time spent building a kit, in milliseconds, and what the library reports
+// for its samples and for the kit.
+struct kit_timing
+{
+  double load;
+  double write;
+  op1_stats samples;
+  op1_stats kit;
+};
+
+// Add the statistics of a sample to `total`.
+void add_stats(op1_stats * total, const op1_stats & stats)
+{
+  total->decode_ns += stats.decode_ns;
+  total->convert_ns += stats.convert_ns;
+  total->serialize_ns += stats.serialize_ns;
+  total->encode_ns += stats.encode_ns;
+  total->patch_ns += stats.patch_ns;
+  total->bytes_in += stats.bytes_in;
+  total->bytes_out += stats.bytes_out;
+  total->allocations += stats.allocations;
+  total->cache_hits += stats.cache_hits;
+  total->cache_misses += stats.cache_misses;
+}
+
+double milliseconds_since(chrono::steady_clock::time_point start)
+{
+  chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Set an array parameter of `drum` if `values` has been specified.
+int set_array(op1_drum * drum, int (*setter)(op1_drum *, int *),
+              vector<int> values, size_t size, const char * name,
+              string * error)
+{
+  if (values.empty()) {
+    return OP1_SUCCESS;
+  }
+  if (values.size() != size) {
+    *error = string(name) + " needs " + to_string(size) + " values";
+    return OP1_ARGUMENT_ERROR;
+  }
+  int rv = setter(drum, values.data());
+  if (rv) {
+    *error = string("invalid ") + name;
+  }
+  return rv;
+}
+
+// Load the samples of `k`, decoding up to `jobs` of them at once, and write
+// the drum kit. On failure, `error` describes what went wrong.
+int build_kit(const kit & k, unsigned jobs, kit_timing * timing, string * error)
+{
+  PodZero(*timing);
+
+  if (k.files.empty() || k.files.size() > 24) {
+    *error = "a kit needs between 1 and 24 files";
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  if (k.options.resample_quality < 0 || k.options.downmix < 0 || k.fit < 0) {
+    *error = "invalid resample quality, downmix or fit policy";
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  op1_drum * drum;
+  if (op1_drum_init(&drum)) {
+    *error = "could not allocate memory";
+    return OP1_ERROR;
+  }
+
+  auto start = chrono::steady_clock::now();
+
+  vector<const char *> names;
+  for (size_t i = 0; i < k.files.size(); i++) {
+    names.push_back(k.files[i].c_str());
+  }
+  vector<audio_file *> files(names.size());
+  vector<int> results(names.size());
+
+  int rv = op1_sample_load_many(names.data(), names.size(), &k.options, jobs,
+                                files.data(), results.data());
+
+  for (size_t i = 0; i < files.size(); i++) {
+    if (results[i] == OP1_ARGUMENT_ERROR) {
+      // the same options are used for all the files
+      *error = "invalid trim options";
+      rv = OP1_ARGUMENT_ERROR;
+    }
+  }
+
+  for (size_t i = 0; i < files.size(); i++) {
+    if (results[i] != OP1_SUCCESS) {
+      if (rv == OP1_ARGUMENT_ERROR) {
+        continue;
+      }
+      if (error->empty()) {
+        *error = "could not load " + k.files[i];
+      } else {
+        *error += ", " + k.files[i];
+      }
+      continue;
+    }
+    if (rv != OP1_ARGUMENT_ERROR) {
+      op1_stats stats;
+      op1_sample_get_stats(files[i], &stats);
+      add_stats(&timing->samples, stats);
+      if (op1_drum_add_sample(drum, files[i])) {
+        *error += string(error->empty() ? "" : ", ") + "could not add " +
+                  k.files[i];
+        rv = OP1_ERROR;
+      }
+    }
+    // the kit holds its own reference, if it was added
+    op1_sample_destroy(files[i]);
+  }
+
+  timing->load = milliseconds_since(start);
+
+  if (rv == OP1_SUCCESS && op1_drum_set_fx(drum, k.fx_type.c_str())) {
+    *error = "invalid fx type " + k.fx_type;
+    rv = OP1_ARGUMENT_ERROR;
+  }
+  if (rv == OP1_SUCCESS && op1_drum_set_lfo(drum, k.lfo_type.c_str())) {
+    *error = "invalid lfo type " + k.lfo_type;
+    rv = OP1_ARGUMENT_ERROR;
+  }
+  if (rv == OP1_SUCCESS) {
+    op1_drum_set_fx_active(drum, k.fx_on);
+    op1_drum_set_lfo_active(drum, k.lfo_on);
+    rv = set_array(drum, op1_drum_set_fx_params, k.fx_params, 8, "fx_params", error);
+  }
+  if (rv == OP1_SUCCESS) {
+    rv = set_array(drum, op1_drum_set_lfo_params, k.lfo_params, 8, "lfo_params", error);
+  }
+  if (rv == OP1_SUCCESS) {
+    rv = set_array(drum, op1_drum_set_pitches, k.pitches, 24, "pitch", error);
+  }
+  if (rv == OP1_SUCCESS) {
+    rv = set_array(drum, op1_drum_set_volumes, k.volumes, 24, "volume", error);
+  }
+  if (rv == OP1_SUCCESS) {
+    rv = set_array(drum, op1_drum_set_playmode, k.playmode, 24, "playmode", error);
+  }
+  if (rv == OP1_SUCCESS) {
+    rv = set_array(drum, op1_drum_set_playback_direction, k.reverse, 24, "reverse", error);
+  }
+  if (rv == OP1_SUCCESS && k.fit) {
+    rv = op1_drum_fit(drum, k.fit - 1, nullptr);
+    if (rv) {
+      *error = "could not fit the kit";
+    }
+  }
+
+  if (rv == OP1_SUCCESS) {
+    start = chrono::steady_clock::now();
+    rv = op1_drum_write(drum, k.output.c_str());
+    timing->write = milliseconds_since(start);
+    if (rv == OP1_OVER_BUDGET) {
+      *error = "the kit is longer than 12 seconds, see -fit";
+    } else if (rv) {
+      *error = "could not write " + k.output;
+    }
+  }
+
+  op1_drum_get_stats(drum, &timing->kit);
+  op1_drum_destroy(drum);
+
+  return rv;
+}
+
+// Fill in `k` from a manifest entry, using `defaults` for what is not
+// specified. Throws on malformed entries.
+void parse_kit(const json & entry, const kit & defaults, kit * k)
+{
+  *k = defaults;
+
+  k->output = entry.at("output").get<string>();
+  k->files = entry.at("files").get<vector<string>>();
+
+  if (entry.count("resample")) {
+    k->options.resample_quality =
+      find_name(QUALITIES, entry["resample"].get<string>().c_str());
+  }
+  if (entry.count("downmix")) {
+    k->options.downmix =
+      find_name(DOWNMIXES, entry["downmix"].get<string>().c_str());
+  }
+  if (entry.count("normalize")) {
+    k->options.normalize = entry["normalize"].get<bool>() ?
+                           OP1_NORMALIZE_PEAK : OP1_NORMALIZE_NONE;
+  }
+  if (entry.count("trim")) {
+    k->options.trim = entry["trim"].get<bool>();
+  }
+  if (entry.count("fit")) {
+    k->fit = find_name(FITS, entry["fit"].get<string>().c_str());
+  }
+  if (entry.count("fx_type")) {
+    k->fx_type = entry["fx_type"].get<string>();
+  }
+  if (entry.count("fx_active")) {
+    k->fx_on = entry["fx_active"].get<bool>();
+  }
+  if (entry.count("fx_params")) {
+    k->fx_params = entry["fx_params"].get<vector<int>>();
+  }
+  if (entry.count("lfo_type")) {
+    k->lfo_type = entry["lfo_type"].get<string>();
+  }
+  if (entry.count("lfo_active")) {
+    k->lfo_on = entry["lfo_active"].get<bool>();
+  }
+  if (entry.count("lfo_params")) {
+    k->lfo_params = entry["lfo_params"].get<vector<int>>();
+  }
+  if (entry.count("pitch")) {
+    k->pitches = entry["pitch"].get<vector<int>>();
+  }
+  if (entry.count("volume")) {
+    k->volumes = entry["volume"].get<vector<int>>();
+  }
+  if (entry.count("playmode")) {
+    k->playmode = entry["playmode"].get<vector<int>>();
+  }
+  if (entry.count("reverse")) {
+    k->reverse = entry["reverse"].get<vector<int>>();
+  }
+}
+
+// Read the entries of a manifest: a JSON array of kits, an object with a
+// "kits" array, or one JSON object per line. Returns false if it can't be
+// read.
+bool read_manifest(const char * path, vector<json> * entries)
 {
-  int16_t max_abs = 0;
+  ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  stringstream contents;
+  contents << in.rdbuf();
+  string text = contents.str();
+
+  try {
+    json document = json::parse(text);
+    if (document.is_object() && document.count("kits")) {
+      document = document["kits"];
+    }
+    if (document.is_array()) {
+      for (size_t i = 0; i < document.size(); i++) {
+        entries->push_back(document[i]);
+      }
+    } else {
+      entries->push_back(document);
+    }
+    return true;
+  } catch (exception &) {
+    // not a single document, try JSON lines
+  }
+
+  istringstream lines(text);
+  string line;
+  while (getline(lines, line)) {
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+      continue;
+    }
+    try {
+      entries->push_back(json::parse(line));
+    } catch (exception &) {
+      // reported as a failed kit, the others are still built
+      entries->push_back(json());
+    }
+  }
+
+  return true;
+}
 
-  for (int i = 0; i < sample_count; i++) {
-    max_abs = max<int16_t>(abs(samples[i]), max_abs);
+// Build all the kits of `manifest` on `threads` threads, decoding `jobs` files
+// at once for each, and write one JSON
+// line per kit to `results`, as they finish. Returns the number of kits that
+// failed.
+size_t run_batch(const char * manifest, const kit & defaults, unsigned threads,
+                 unsigned jobs, FILE * results)
+{
+  vector<json> entries;
+  if (!read_manifest(manifest, &entries)) {
+    FATAL("Could not read the manifest.");
   }
-  float gain = (2 << 14) / max_abs;
 
-  for (int i = 0; i < sample_count; i++) {
-    samples[i] = samples[i] * gain;
+  mutex results_lock;
+  size_t failures = 0;
+
+  parallel_for(entries.size(), threads, [&](size_t i) {
+    auto start = chrono::steady_clock::now();
+    kit_timing timing;
+    PodZero(timing);
+    string error;
+    kit k;
+    int rv;
+
+    try {
+      parse_kit(entries[i], defaults, &k);
+      // kits are already built in parallel
+      rv = build_kit(k, jobs ? jobs : 1, &timing, &error);
+    } catch (exception & e) {
+      error = string("invalid manifest entry: ") + e.what();
+      rv = OP1_ARGUMENT_ERROR;
+    }
+
+    json result;
+    result["kit"] = i;
+    result["output"] = k.output;
+    result["status"] = rv == OP1_SUCCESS ? "ok" : "error";
+    if (rv != OP1_SUCCESS) {
+      result["error"] = error;
+      result["code"] = rv;
+    }
+    result["load_ms"] = timing.load;
+    result["write_ms"] = timing.write;
+    result["total_ms"] = milliseconds_since(start);
+    result["decode_ms"] = timing.samples.decode_ns / 1e6;
+    result["convert_ms"] = (timing.samples.convert_ns +
+                            timing.kit.convert_ns) / 1e6;
+    result["serialize_ms"] = timing.kit.serialize_ns / 1e6;
+    result["encode_ms"] = timing.kit.encode_ns / 1e6;
+    result["bytes_in"] = timing.samples.bytes_in;
+    result["bytes_out"] = timing.kit.bytes_out;
+    result["decode_cache_hits"] = timing.samples.cache_hits;
+    string line = result.dump();
+
+    lock_guard<mutex> lock(results_lock);
+    if (rv != OP1_SUCCESS) {
+      failures++;
+    }
+    fprintf(results, "%s\n", line.c_str());
+    fflush(results);
+  });
+
+  fprintf(stderr, "%zu kits, %zu failed\n", entries.size(), failures);
+
+  op1_sample_cache_stats stats;
+  op1_sample_cache_get_stats(&stats);
+  if (stats.hits + stats.misses) {
+    fprintf(stderr, "decode cache: %" PRIu64 " hits, %" PRIu64 " misses, %"
+            PRIu64 " evictions, %zu samples in %.1fMB\n", stats.hits,
+            stats.misses, stats.evictions, stats.entries,
+            stats.bytes / (1024.0 * 1024.0));
   }
+
+  return failures;
+}
 }
 
 int main(int argc, const char ** argv) {
@@ -29,15 +415,37 @@ int main(int argc, const char ** argv) {
 
   parser.help() << R"(op1-drum
     Usage: op1-drum [options] audio-file [audio-file ...] -o output.aif
+           op1-drum [options] -batch manifest.json [-results results.jsonl]
 
-    Creates an AIFF file for use with an OP-1, with start and end marker included in the file.)";
+    Creates an AIFF file for use with an OP-1, with start and end marker included in the file.
+    In batch mode, builds all the kits of a manifest concurrently, the other options being the defaults of each kit.)";
 
   auto output = parser.option("output")
                       .alias("o")
-                      .description("Output file")
-                      .required()
+                      .description("Output file, required unless -batch is used")
                       .getValue();
 
+  auto batch = parser.option("batch")
+                     .alias("b")
+                     .description("A JSON or JSON-lines manifest of kits to build.")
+                     .getValue();
+
+  auto results = parser.option("results")
+                       .description("Where to write the status of each kit in batch mode, as JSON lines. Defaults to the standard output.")
+                       .getValue();
+
+  auto threads = parser.option("threads")
+                       .alias("t")
+                       .description("Number of kits built at once in batch mode, 0 for one per core.")
+                       .defaultValue("0")
+                       .getValueAs<unsigned>();
+
+  auto jobs = parser.option("jobs")
+                    .alias("j")
+                    .description("Number of files decoded at once for each kit, 0 for one per core, or one in batch mode.")
+                    .defaultValue("0")
+                    .getValueAs<unsigned>();
+
   auto fx_type = parser.option("fxtype")
                        .alias("fx")
                        .description("Effect type, one of 'cwo', 'delay', 'grid', 'nitro', 'phone', 'punch' or 'spring'.")
@@ -58,96 +466,134 @@ int main(int argc, const char ** argv) {
                      .description("Whether the LFO is on by default or not.")
                      .getValue();
 
+  auto resample = parser.option("resample")
+                        .alias("r")
+                        .description("Quality of the conversion of samples to 44.1kHz, one of 'none', 'fast', 'medium' or 'best'.")
+                        .defaultValue("medium")
+                        .getValue();
+
+  auto downmix = parser.option("downmix")
+                       .alias("m")
+                       .description("How to convert files to mono, one of 'average', 'left', 'right', 'mid' or 'max-energy'.")
+                       .defaultValue("average")
+                       .getValue();
+
   auto normalize = parser.flag("normalize")
                          .alias("n")
                          .description("Normalize each sample before creating the output file.")
                          .getValue();
 
-  g_logging_enabled = parser.flag("debug")
-                            .alias("d")
-                            .description("Enabled console debug print outs.")
-                            .getValue();
-
-  op1_drum * drum;
-
-  if (op1_drum_init(&drum)) {
-    FATAL("Could not allocate memory.");
-    return EXIT_FAILURE;
-  }
-
-  if (op1_drum_set_fx(drum, fx_type)) {
-    parser.showHelp();
-    return EXIT_FAILURE;
-  }
+  auto trim = parser.flag("trim")
+                    .description("Remove the silence at the start and end of each sample.")
+                    .getValue();
+
+  auto trim_threshold = parser.option("trimthreshold")
+                              .description("Level under which audio is silent when trimming, in dBFS.")
+                              .defaultValue("-60")
+                              .getValueAs<float>();
+
+  auto trim_hold = parser.option("trimhold")
+                         .description("Time kept after the last frame above the threshold when trimming, in milliseconds.")
+                         .defaultValue("20")
+                         .getValueAs<float>();
+
+  auto trim_pre_roll = parser.option("trimpreroll")
+                             .description("Time kept before the first frame above the threshold when trimming, in milliseconds.")
+                             .defaultValue("2")
+                             .getValueAs<float>();
+
+  auto cache = parser.option("cache")
+                     .alias("c")
+                     .description("Memory used to keep decoded samples that several kits use, in MB, 0 to decode them for each kit.")
+                     .defaultValue("0")
+                     .getValueAs<unsigned>();
+
+  auto fit = parser.option("fit")
+                   .alias("f")
+                   .description("How to shorten kits longer than 12 seconds, one of 'none', 'truncate', 'trim-silence' or 'compress'.")
+                   .defaultValue("none")
+                   .getValue();
+
+  auto debug = parser.flag("debug")
+                    .alias("d")
+                    .description("Enabled console debug print outs.")
+                    .getValue();
 
   if (parser.hasErrors()) {
     return EXIT_FAILURE;
   }
 
-  parser.getRemainingArguments(argc, argv);
-  // load all files
-  vector<audio_file*> files;
-
-  if (argc >= 25) {
-    parser.showHelp();
-    FATAL("No more than 24 files on an op-1.");
+  if (debug) {
+    op1_set_log_callback(OP1_LOG_DEBUG, nullptr, nullptr);
   }
 
-  if (argc == 1) {
+  kit k;
+  op1_sample_options_init(&k.options);
+  k.options.resample_quality = find_name(QUALITIES, resample);
+  k.options.downmix = find_name(DOWNMIXES, downmix);
+  if (normalize) {
+    k.options.normalize = OP1_NORMALIZE_PEAK;
+  }
+  k.options.trim = trim;
+  k.options.trim_options.threshold_db = trim_threshold;
+  k.options.trim_options.hold_ms = trim_hold;
+  k.options.trim_options.pre_roll_ms = trim_pre_roll;
+  k.fit = find_name(FITS, fit);
+  k.fx_type = fx_type;
+  k.fx_on = fx_on;
+  k.lfo_type = lfo_type;
+  k.lfo_on = lfo_on;
+
+  if (k.options.resample_quality < 0 || k.options.downmix < 0 || k.fit < 0) {
     parser.showHelp();
-    FATAL("Need some audio files as arguments.");
+    return EXIT_FAILURE;
   }
 
-  for (uint32_t i = 1; i < argc; i++) {
-    audio_file * file;
-    op1_sample_load(argv[i], &file);
-    files.push_back(file);
-  }
+  op1_sample_cache_enable(size_t(cache) * 1024 * 1024);
 
-  if (normalize) {
-    for (uint32_t i = 0; i < files.size(); i++) {
-      int16_t * samples;
-      size_t sample_count;
-      op1_sample_get_data(files[i], &samples, &sample_count);
-      normalize_buffer(samples, sample_count);
+  if (batch) {
+    FILE * out = stdout;
+    if (results) {
+      out = fopen(results, "w");
+      if (!out) {
+        FATAL("Could not open the results file.");
+      }
     }
+    size_t failures = run_batch(batch, k, threads, jobs, out);
+    if (out != stdout) {
+      fclose(out);
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
   }
 
-  for (uint32_t i = 0; i < files.size(); i++) {
-    op1_drum_add_sample(drum, files[i]);
-  }
-
-  int rv;
-
-  rv = op1_drum_set_fx(drum, fx_type);
-  if (rv) {
-    WARN("Could not set fx type.");
+  if (!output) {
     parser.showHelp();
+    FATAL("Need an output file.");
   }
 
-  rv = op1_drum_set_fx_active(drum, fx_on);
-  if (rv) {
-    WARN("Could not set fx active.");
+  parser.getRemainingArguments(argc, argv);
+
+  if (argc >= 26) {
     parser.showHelp();
+    FATAL("No more than 24 files on an op-1.");
   }
 
-  rv = op1_drum_set_lfo(drum, lfo_type);
-  if (rv) {
-    WARN("Could not set lfo type.");
+  if (argc == 1) {
     parser.showHelp();
+    FATAL("Need some audio files as arguments.");
   }
 
-  rv = op1_drum_set_lfo_active(drum, lfo_on);
-  if (rv) {
-    WARN("Could not set lfo active.");
-    parser.showHelp();
+  k.output = output;
+  for (int i = 1; i < argc; i++) {
+    k.files.push_back(argv[i]);
   }
 
-  rv = op1_drum_write(drum, output);
-  if (rv) {
-    WARN("Could not write the output file.");
-    return 1;
+  kit_timing timing;
+  string error;
+  if (build_kit(k, jobs, &timing, &error)) {
+    WARN(error.c_str());
+    return EXIT_FAILURE;
   }
 
-  return 0;
+  return EXIT_SUCCESS;
 }
@@ -1,54 +1,121 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include "cli.hpp"
+#include "json.hpp"
+#include "op1.h"
+#include "op1_aiff.h"
+#include "op1_mmap.h"
+#include "op1_thread_pool.h"
 
-int main(int argc, const char ** argv) 
+using namespace std;
+using json = nlohmann::json;
+
+namespace {
+// Files read before their output is written, so that it is in the order of
+// the arguments without holding all of it.
+const size_t DUMP_BATCH_FILES = 1024;
+
+// What is printed for a file, `failed` if it could not be read.
+struct dump_result
+{
+  string text;
+  bool failed;
+};
+
+// Read the JSON document of `file_name`, and format it as a line of output.
+void dump_file(const char * file_name, bool json_lines, dump_result * result)
+{
+  mapped_file mapping;
+  const char * appl = nullptr;
+  size_t appl_length = 0;
+  string error;
+
+  // only the chunk headers are read, don't read ahead the audio
+  if (mapping.open(file_name, false) != OP1_SUCCESS) {
+    error = "could not open the file";
+  } else if (aiff_find_appl(mapping.data(), mapping.size(), &appl,
+                            &appl_length) != OP1_SUCCESS) {
+    error = "not an OP-1 AIFF file";
+  }
+
+  result->failed = !error.empty();
+
+  if (!json_lines) {
+    if (result->failed) {
+      result->text = string(file_name) + ": " + error;
+    } else {
+      result->text.assign(appl, appl_length);
+    }
+    return;
+  }
+
+  json record;
+  record["file"] = file_name;
+  if (!result->failed) {
+    try {
+      record["appl"] = json::parse(string(appl, appl_length));
+    } catch (exception &) {
+      error = "invalid JSON document";
+      result->failed = true;
+    }
+  }
+  record["status"] = result->failed ? "error" : "ok";
+  if (result->failed) {
+    record["error"] = error;
+  }
+  result->text = record.dump();
+}
+}
+
+int main(int argc, const char ** argv)
 {
   cli::Parser parser(argc, argv);
 
   parser.help() << R"(op1-dump
-    Usage: op1-drum audio-file.aif [audio-file2.aif...]
+    Usage: op1-dump [options] audio-file.aif [audio-file2.aif...]
 
     Dumps on stdout the proprietary JSON of a OP-1 drum or synth sample.)";
 
-  parser.getRemainingArguments(argc, argv);
+  auto json_lines = parser.flag("jsonl")
+                          .description("Print one JSON record per file, with its name and status.")
+                          .getValue();
 
-  for (int argindex = 1; argindex < argc - 1; argindex++) {
-    FILE* f = fopen(argv[argindex], "r");
+  auto threads = parser.option("threads")
+                       .alias("t")
+                       .description("Number of files read at once, 0 for one per core.")
+                       .defaultValue("0")
+                       .getValueAs<unsigned>();
 
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+  if (parser.hasErrors()) {
+    return EXIT_FAILURE;
+  }
 
-    uint8_t* buf = (uint8_t*)malloc(fsize);
-    fread(buf, fsize, 1, f);
-    fclose(f);
+  parser.getRemainingArguments(argc, argv);
 
-    size_t i = 0;
-    while (i < fsize - 4) {
-      if (buf[i + 0] == 'A' &&
-          buf[i + 1] == 'P' &&
-          buf[i + 2] == 'P' &&
-          buf[i + 3] == 'L') {
-        break;
-      }
-      i++;
-    }
+  size_t count = argc - 1;
+  size_t failures = 0;
+  vector<dump_result> results;
 
-    uint32_t chunk_size_index = i + 4;
+  for (size_t first = 0; first < count; first += DUMP_BATCH_FILES) {
+    results.assign(min(DUMP_BATCH_FILES, count - first), dump_result());
 
-    int32_t chunk_size = (buf[chunk_size_index + 3] << 0)
-                       | (buf[chunk_size_index + 2] << 8)
-                       | (buf[chunk_size_index + 1] << 16)
-                       | (buf[chunk_size_index + 0] << 24);
+    parallel_for(results.size(), threads, [&](size_t i) {
+      dump_file(argv[1 + first + i], json_lines, &results[i]);
+    });
 
-    for (uint32_t i = 0; i < chunk_size - 4; i++) {
-      printf("%c", buf[chunk_size_index + 8 + i]);
+    for (size_t i = 0; i < results.size(); i++) {
+      if (results[i].failed) {
+        failures++;
+      }
+      // errors go with the records in JSON-lines mode
+      FILE * out = results[i].failed && !json_lines ? stderr : stdout;
+      fprintf(out, "%s\n", results[i].text.c_str());
     }
-    printf("\n");
-
   }
 
-  return 0;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,194 @@
+#include "cli.hpp"
+#include "json.hpp"
+#include "op1.h"
+#include "op1_index.h"
+#include <chrono>
+#include <cinttypes>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace {
+// What a kit has to match to be listed. Empty or negative values match
+// anything.
+struct kit_query
+{
+  string fx_type;
+  string lfo_type;
+  double min_seconds;
+  double max_seconds;
+  string hash;
+};
+
+string hash_to_string(uint64_t hash)
+{
+  char text[17];
+  snprintf(text, sizeof(text), "%016" PRIx64, hash);
+  return text;
+}
+
+bool matches(const kit_record & record, const kit_query & query)
+{
+  double seconds = record.rate ? double(record.frame_count) / record.rate : 0.0;
+
+  return (query.fx_type.empty() || record.fx_type == query.fx_type) &&
+         (query.lfo_type.empty() || record.lfo_type == query.lfo_type) &&
+         (query.min_seconds < 0.0 || seconds >= query.min_seconds) &&
+         (query.max_seconds < 0.0 || seconds <= query.max_seconds) &&
+         (query.hash.empty() || hash_to_string(record.hash) == query.hash);
+}
+
+json record_to_json(const kit_record & record)
+{
+  json j;
+
+  j["path"] = record.path;
+  j["hash"] = hash_to_string(record.hash);
+  j["rate"] = record.rate;
+  j["frames"] = record.frame_count;
+  j["fx_type"] = record.fx_type;
+  j["fx_active"] = record.fx_active;
+  j["fx_params"] = record.fx_params;
+  j["lfo_type"] = record.lfo_type;
+  j["lfo_active"] = record.lfo_active;
+  j["lfo_params"] = record.lfo_params;
+  j["dyna_env"] = record.enveloppe;
+  j["pitch"] = record.pitches;
+  j["volume"] = record.volumes;
+  j["playmode"] = record.playmode;
+  j["reverse"] = record.playback_direction;
+  j["start"] = record.start_times;
+  j["end"] = record.end_times;
+
+  return j;
+}
+
+double milliseconds_since(chrono::steady_clock::time_point start)
+{
+  chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+}
+
+int main(int argc, const char ** argv)
+{
+  cli::Parser parser(argc, argv);
+
+  parser.help() << R"(op1-index
+    Usage: op1-index -index library.op1i [-update directory] [query options]
+
+    Keeps an index of the OP-1 drum kits of a library, and lists the kits that match a query, without reading them.
+    Updating only reads the kits that are new or have changed since the last update.)";
+
+  auto index = parser.option("index")
+                     .alias("i")
+                     .description("The index file, created if needed.")
+                     .getValue();
+
+  auto update = parser.option("update")
+                      .alias("u")
+                      .description("A directory whose kits are indexed before answering the query.")
+                      .getValue();
+
+  auto threads = parser.option("threads")
+                       .alias("t")
+                       .description("Number of kits read at once when updating, 0 for one per core.")
+                       .defaultValue("0")
+                       .getValueAs<unsigned>();
+
+  auto fx_type = parser.option("fxtype")
+                       .alias("fx")
+                       .description("Only list the kits that use this effect.")
+                       .getValue();
+
+  auto lfo_type = parser.option("lfotype")
+                        .alias("lfo")
+                        .description("Only list the kits that use this LFO.")
+                        .getValue();
+
+  auto min_seconds = parser.option("minduration")
+                           .description("Only list the kits at least this long, in seconds.")
+                           .defaultValue("-1")
+                           .getValueAs<double>();
+
+  auto max_seconds = parser.option("maxduration")
+                           .description("Only list the kits at most this long, in seconds.")
+                           .defaultValue("-1")
+                           .getValueAs<double>();
+
+  auto hash = parser.option("hash")
+                    .description("Only list the kits with this content hash, as printed with -jsonl.")
+                    .getValue();
+
+  auto json_lines = parser.flag("jsonl")
+                          .description("Print the record of each kit as a JSON line, instead of its path.")
+                          .getValue();
+
+  auto quiet = parser.flag("quiet")
+                     .alias("q")
+                     .description("Only update the index, don't list any kit.")
+                     .getValue();
+
+  if (parser.hasErrors()) {
+    return EXIT_FAILURE;
+  }
+
+  if (!index) {
+    parser.showHelp();
+    FATAL("Need an index file.");
+  }
+
+  vector<kit_record> records;
+  int rv = index_load(index, &records);
+  if (rv == OP1_ERROR) {
+    FATAL("Not an index file.");
+  }
+  if (rv != OP1_SUCCESS && !update) {
+    FATAL("Could not read the index.");
+  }
+
+  if (update) {
+    auto start = chrono::steady_clock::now();
+    index_stats stats;
+    if (index_update(update, threads, &records, &stats) != OP1_SUCCESS) {
+      FATAL("Could not read the directory.");
+    }
+    if (index_save(index, records) != OP1_SUCCESS) {
+      FATAL("Could not write the index.");
+    }
+    fprintf(stderr, "%zu kits: %zu unchanged, %zu read, %zu failed, %zu removed"
+            " in %.0fms\n", records.size(), stats.kept, stats.indexed,
+            stats.failed, stats.removed, milliseconds_since(start));
+    if (stats.unreadable) {
+      fprintf(stderr, "Warning: %zu directories could not be read, their kits"
+              " were left as is\n", stats.unreadable);
+    }
+  }
+
+  if (quiet) {
+    return EXIT_SUCCESS;
+  }
+
+  kit_query query;
+  query.fx_type = fx_type ? fx_type : "";
+  query.lfo_type = lfo_type ? lfo_type : "";
+  query.min_seconds = min_seconds;
+  query.max_seconds = max_seconds;
+  query.hash = hash ? hash : "";
+
+  for (size_t i = 0; i < records.size(); i++) {
+    if (!matches(records[i], query)) {
+      continue;
+    }
+    if (json_lines) {
+      printf("%s\n", record_to_json(records[i]).dump().c_str());
+    } else {
+      printf("%s\n", records[i].path.c_str());
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#include "cli.hpp"
+#include "op1.h"
+#include "op1_thread_pool.h"
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+namespace {
+// `path` without its directory and extension.
+string stem(const string & path)
+{
+  size_t slash = path.find_last_of('/');
+  string name = slash == string::npos ? path : path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  return dot == string::npos || !dot ? name : name.substr(0, dot);
+}
+
+// Whether slot `index` has audio that no slot before it has. Unused slots
+// repeat the last used one.
+bool is_new_slice(const op1_slice slices[24], size_t index)
+{
+  if (!slices[index].frame_count) {
+    return false;
+  }
+  for (size_t i = 0; i < index; i++) {
+    if (slices[i].start == slices[index].start &&
+        slices[i].frame_count == slices[index].frame_count) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write the slices of `kit` to `directory`, or print them if it is null.
+// Returns false if the kit could not be read or a slice not written.
+bool slice_kit(const char * kit, const char * directory, mutex & output_lock)
+{
+  op1_drum * drum;
+  if (op1_drum_load(kit, &drum)) {
+    lock_guard<mutex> lock(output_lock);
+    fprintf(stderr, "Warning: could not read %s\n", kit);
+    return false;
+  }
+
+  op1_slice slices[24];
+  bool ok = op1_drum_get_slices(drum, slices) == OP1_SUCCESS;
+
+  for (size_t i = 0; ok && i < 24; i++) {
+    if (!is_new_slice(slices, i)) {
+      continue;
+    }
+    if (!directory) {
+      lock_guard<mutex> lock(output_lock);
+      printf("%s\t%zu\t%zu\t%zu\n", kit, i + 1, slices[i].start,
+             slices[i].frame_count);
+      continue;
+    }
+    char number[4];
+    snprintf(number, sizeof(number), "%02d", int(i + 1));
+    string path = string(directory) + "/" + stem(kit) + "-" + number + ".aif";
+    if (op1_drum_write_slice(drum, i, path.c_str())) {
+      lock_guard<mutex> lock(output_lock);
+      fprintf(stderr, "Warning: could not write %s\n", path.c_str());
+      ok = false;
+    }
+  }
+
+  op1_drum_destroy(drum);
+
+  return ok;
+}
+}
+
+int main(int argc, const char ** argv)
+{
+  cli::Parser parser(argc, argv);
+
+  parser.help() << R"(op1-slice
+    Usage: op1-slice [options] kit.aif [kit.aif...]
+
+    Takes the slices back out of OP-1 drum kits: prints the slot number, first frame and length of each slice, or writes each of them to its own AIFF file.
+    Empty slots and slots that repeat an earlier slice are skipped.)";
+
+  auto output = parser.option("output")
+                      .alias("o")
+                      .description("Directory where each slice is written as kit-NN.aif.")
+                      .getValue();
+
+  auto threads = parser.option("threads")
+                       .alias("t")
+                       .description("Number of kits sliced at once, 0 for one per core.")
+                       .defaultValue("0")
+                       .getValueAs<unsigned>();
+
+  if (parser.hasErrors()) {
+    return EXIT_FAILURE;
+  }
+
+  parser.getRemainingArguments(argc, argv);
+
+  if (argc == 1) {
+    parser.showHelp();
+    FATAL("Need some drum kits as arguments.");
+  }
+
+  mutex output_lock;
+  size_t failures = 0;
+
+  parallel_for(argc - 1, threads, [&](size_t i) {
+    if (!slice_kit(argv[i + 1], output, output_lock)) {
+      lock_guard<mutex> lock(output_lock);
+      failures++;
+    }
+  });
+
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
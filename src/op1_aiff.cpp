@@ -0,0 +1,308 @@
+#include <cmath>
+#include <cstring>
+
+#include "op1.h"
+#include "op1_aiff.h"
+
+namespace {
+
+// chunk header: id + size
+const size_t CHUNK_HEADER_SIZE = 8;
+// channels, frames, sample size, 80-bit sample-rate
+const size_t COMM_SIZE = 18;
+// offset and block size, before the sample data
+const size_t SSND_PREAMBLE_SIZE = 8;
+// 'op-1', before the JSON document
+const size_t APPL_SIGNATURE_SIZE = 4;
+
+uint8_t * write_id(uint8_t * out, const char id[4])
+{
+  memcpy(out, id, 4);
+  return out + 4;
+}
+
+uint8_t * write_be16(uint8_t * out, uint16_t value)
+{
+  out[0] = value >> 8;
+  out[1] = value;
+  return out + 2;
+}
+
+uint8_t * write_be32(uint8_t * out, uint32_t value)
+{
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >>  8;
+  out[3] = value;
+  return out + 4;
+}
+
+// The COMM chunk stores the sample-rate as an IEEE 754 80-bit extended float.
+uint8_t * write_extended(uint8_t * out, uint32_t value)
+{
+  memset(out, 0, 10);
+
+  if (!value) {
+    return out + 10;
+  }
+
+  uint16_t exponent = 16383 + 31;
+  while (!(value & 0x80000000)) {
+    value <<= 1;
+    exponent--;
+  }
+
+  write_be16(out, exponent);
+  write_be32(out + 2, value);
+
+  return out + 10;
+}
+
+uint32_t read_be32(const uint8_t * in)
+{
+  return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) |
+         (uint32_t(in[2]) <<  8) |  uint32_t(in[3]);
+}
+
+bool has_id(const uint8_t * in, const char id[4])
+{
+  return !memcmp(in, id, 4);
+}
+
+size_t appl_chunk_size(size_t appl_length)
+{
+  return APPL_SIGNATURE_SIZE + appl_length;
+}
+
+size_t padded(size_t chunk_size)
+{
+  return chunk_size + (chunk_size & 1);
+}
+
+}
+
+size_t aiff_header_size(size_t appl_length)
+{
+  return CHUNK_HEADER_SIZE + 4 /* 'AIFF' */ +
+         CHUNK_HEADER_SIZE + COMM_SIZE +
+         CHUNK_HEADER_SIZE + padded(appl_chunk_size(appl_length)) +
+         CHUNK_HEADER_SIZE + SSND_PREAMBLE_SIZE;
+}
+
+size_t aiff_file_size(size_t appl_length, size_t frame_count)
+{
+  return aiff_header_size(appl_length) + frame_count * sizeof(int16_t);
+}
+
+size_t aiff_plain_header_size()
+{
+  return CHUNK_HEADER_SIZE + 4 /* 'AIFF' */ +
+         CHUNK_HEADER_SIZE + COMM_SIZE +
+         CHUNK_HEADER_SIZE + SSND_PREAMBLE_SIZE;
+}
+
+namespace {
+uint8_t * write_form_and_comm(uint8_t * out, size_t total, uint32_t rate,
+                              size_t frame_count)
+{
+  out = write_id(out, "FORM");
+  out = write_be32(out, total - CHUNK_HEADER_SIZE);
+  out = write_id(out, "AIFF");
+
+  out = write_id(out, "COMM");
+  out = write_be32(out, COMM_SIZE);
+  out = write_be16(out, 1); // drums are mono
+  out = write_be32(out, frame_count);
+  out = write_be16(out, 16);
+  return write_extended(out, rate);
+}
+
+uint8_t * write_ssnd_header(uint8_t * out, size_t frame_count)
+{
+  out = write_id(out, "SSND");
+  out = write_be32(out, SSND_PREAMBLE_SIZE + frame_count * sizeof(int16_t));
+  out = write_be32(out, 0); // offset
+  return write_be32(out, 0); // block size
+}
+}
+
+uint8_t * aiff_write_header(uint8_t * out, uint32_t rate, size_t frame_count,
+                            const char * appl, size_t appl_length)
+{
+  size_t total = aiff_file_size(appl_length, frame_count);
+
+  out = write_form_and_comm(out, total, rate, frame_count);
+
+  size_t appl_size = appl_chunk_size(appl_length);
+  out = write_id(out, "APPL");
+  out = write_be32(out, appl_size);
+  out = write_id(out, "op-1");
+  memcpy(out, appl, appl_length);
+  out += appl_length;
+  if (appl_size & 1) {
+    *out++ = 0;
+  }
+
+  return write_ssnd_header(out, frame_count);
+}
+
+uint8_t * aiff_write_plain_header(uint8_t * out, uint32_t rate,
+                                  size_t frame_count)
+{
+  size_t total = aiff_plain_header_size() + frame_count * sizeof(int16_t);
+
+  out = write_form_and_comm(out, total, rate, frame_count);
+
+  return write_ssnd_header(out, frame_count);
+}
+
+uint8_t * aiff_write_frames(uint8_t * out, const int16_t * frames, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    uint16_t frame = frames[i];
+    out[2 * i + 0] = frame >> 8;
+    out[2 * i + 1] = frame;
+  }
+  return out + 2 * count;
+}
+
+namespace {
+uint16_t read_be16(const uint8_t * in)
+{
+  return (uint16_t(in[0]) << 8) | in[1];
+}
+
+double read_extended(const uint8_t * in)
+{
+  int exponent = read_be16(in) & 0x7fff;
+  uint64_t mantissa = (uint64_t(read_be32(in + 2)) << 32) | read_be32(in + 6);
+  double value = ldexp(double(mantissa), exponent - 16383 - 63);
+  return in[0] & 0x80 ? -value : value;
+}
+
+// Call `visit(chunk)` with the header of each chunk of the FORM container of
+// `data`, until it returns true. The body of each chunk is in bounds.
+template<typename F>
+int walk_chunks(const uint8_t * data, size_t size, F visit)
+{
+  if (size < CHUNK_HEADER_SIZE + 4 || !has_id(data, "FORM") ||
+      !(has_id(data + 8, "AIFF") || has_id(data + 8, "AIFC"))) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  // don't trust the FORM size further than the end of the file
+  size_t end = CHUNK_HEADER_SIZE + size_t(read_be32(data + 4));
+  if (end > size) {
+    end = size;
+  }
+
+  size_t offset = CHUNK_HEADER_SIZE + 4;
+  // a FORM too small to hold its own type
+  if (end < offset) {
+    return OP1_ERROR;
+  }
+
+  while (end - offset >= CHUNK_HEADER_SIZE) {
+    const uint8_t * chunk = data + offset;
+    size_t chunk_size = read_be32(chunk + 4);
+    offset += CHUNK_HEADER_SIZE;
+
+    if (chunk_size > end - offset) {
+      return OP1_ERROR;
+    }
+
+    if (visit(chunk)) {
+      return OP1_SUCCESS;
+    }
+
+    // chunks start on even offsets
+    if (padded(chunk_size) > end - offset) {
+      break;
+    }
+    offset += padded(chunk_size);
+  }
+
+  return OP1_SUCCESS;
+}
+
+// Whether `chunk` is the 'op-1' APPL chunk, in which case the JSON document
+// it holds is put in `appl` and `appl_length`.
+bool read_appl(const uint8_t * chunk, const char ** appl, size_t * appl_length)
+{
+  size_t chunk_size = read_be32(chunk + 4);
+  if (!has_id(chunk, "APPL") || chunk_size < APPL_SIGNATURE_SIZE ||
+      !has_id(chunk + CHUNK_HEADER_SIZE, "op-1")) {
+    return false;
+  }
+
+  const char * json = reinterpret_cast<const char *>(
+      chunk + CHUNK_HEADER_SIZE + APPL_SIGNATURE_SIZE);
+  size_t length = chunk_size - APPL_SIGNATURE_SIZE;
+  // some writers pad the document with zeros
+  while (length && !json[length - 1]) {
+    length--;
+  }
+  *appl = json;
+  *appl_length = length;
+
+  return true;
+}
+}
+
+int aiff_find_appl(const uint8_t * data, size_t size, const char ** appl,
+                   size_t * appl_length)
+{
+  bool found = false;
+  int rv = walk_chunks(data, size, [&](const uint8_t * chunk) {
+    found = read_appl(chunk, appl, appl_length);
+    return found;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  return found ? OP1_SUCCESS : OP1_ERROR;
+}
+
+int aiff_read(const uint8_t * data, size_t size, aiff_contents * contents)
+{
+  bool has_comm = false;
+  bool compressed = false;
+
+  memset(contents, 0, sizeof(*contents));
+
+  int rv = walk_chunks(data, size, [&](const uint8_t * chunk) {
+    const uint8_t * body = chunk + CHUNK_HEADER_SIZE;
+    size_t chunk_size = read_be32(chunk + 4);
+
+    if (has_id(chunk, "COMM") && chunk_size >= COMM_SIZE) {
+      has_comm = true;
+      contents->channels = read_be16(body);
+      contents->frame_count = read_be32(body + 2);
+      contents->bits = read_be16(body + 6);
+      contents->rate = read_extended(body + 8);
+      // AIFF-C adds a compression type
+      compressed = has_id(data + 8, "AIFC") &&
+                   (chunk_size < COMM_SIZE + 4 ||
+                    !has_id(body + COMM_SIZE, "NONE"));
+    } else if (has_id(chunk, "SSND") && chunk_size >= SSND_PREAMBLE_SIZE) {
+      size_t offset = read_be32(body);
+      if (offset <= chunk_size - SSND_PREAMBLE_SIZE) {
+        contents->pcm = body + SSND_PREAMBLE_SIZE + offset;
+        contents->pcm_length = chunk_size - SSND_PREAMBLE_SIZE - offset;
+      }
+    } else if (!contents->appl) {
+      read_appl(chunk, &contents->appl, &contents->appl_length);
+    }
+    return false;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  if (!has_comm || compressed || !contents->pcm) {
+    return OP1_ERROR;
+  }
+
+  return OP1_SUCCESS;
+}
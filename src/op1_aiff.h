@@ -0,0 +1,102 @@
+#ifndef OP1_AIFF_H
+#define OP1_AIFF_H
+
+/** @file
+ *     Native writer for the AIFF files the OP-1 understands: a FORM container
+ *     holding a COMM, an APPL ('op-1' JSON) and a SSND chunk, in that order,
+ *     and a reader for the JSON document of existing files. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Size, in bytes, of a complete OP-1 AIFF file.
+ *
+ * @param appl_length The length of the JSON document stored in the APPL chunk.
+ * @param frame_count The number of mono 16-bit frames in the SSND chunk.
+ */
+size_t aiff_file_size(size_t appl_length, size_t frame_count);
+
+/**
+ * Size, in bytes, of everything that precedes the PCM data of the SSND chunk.
+ *
+ * @param appl_length The length of the JSON document stored in the APPL chunk.
+ */
+size_t aiff_header_size(size_t appl_length);
+
+/**
+ * Write the FORM, COMM, APPL and SSND headers, followed by the JSON document,
+ * at `out`, that has to be at least `aiff_header_size(appl_length)` bytes long.
+ *
+ * @returns a pointer just past the header, where the PCM data goes.
+ */
+uint8_t * aiff_write_header(uint8_t * out, uint32_t rate, size_t frame_count,
+                            const char * appl, size_t appl_length);
+
+/**
+ * Size, in bytes, of everything that precedes the PCM data of a plain AIFF
+ * file, that has no APPL chunk.
+ */
+size_t aiff_plain_header_size();
+
+/**
+ * Write the FORM, COMM and SSND headers of a plain mono 16-bit AIFF file at
+ * `out`, that has to be at least `aiff_plain_header_size()` bytes long.
+ *
+ * @returns a pointer just past the header, where the PCM data goes.
+ */
+uint8_t * aiff_write_plain_header(uint8_t * out, uint32_t rate,
+                                  size_t frame_count);
+
+/**
+ * Write `count` native-endian frames as big-endian 16-bit PCM.
+ *
+ * @returns a pointer just past the last frame written.
+ */
+uint8_t * aiff_write_frames(uint8_t * out, const int16_t * frames, size_t count);
+
+/**
+ * What `aiff_read` found in a file. Pointers are into the file.
+ */
+struct aiff_contents
+{
+  uint16_t channels;
+  uint32_t frame_count;
+  uint16_t bits;
+  double rate;
+  // The JSON document of the 'op-1' APPL chunk, null if there is none.
+  const char * appl;
+  size_t appl_length;
+  // Big-endian PCM data of the SSND chunk.
+  const uint8_t * pcm;
+  size_t pcm_length;
+};
+
+/**
+ * Find the 'op-1' APPL chunk of an AIFF or AIFF-C file, by walking the chunks
+ * of the FORM container. Only the chunk headers are read, so the audio data
+ * is never touched.
+ *
+ * @param data The whole file, has to be non-null.
+ * @param size The size of `data`, in bytes.
+ * @param appl Set to the start of the JSON document, in `data`.
+ * @param appl_length Set to the length of the JSON document, without the
+ * padding that might follow it.
+ *
+ * @returns OP1_ARGUMENT_ERROR if `data` is not a FORM container, OP1_ERROR if
+ * it is truncated or has no 'op-1' APPL chunk, OP1_SUCCESS otherwise.
+ */
+int aiff_find_appl(const uint8_t * data, size_t size, const char ** appl,
+                   size_t * appl_length);
+
+/**
+ * Read the format, the 'op-1' APPL chunk and the location of the audio of an
+ * uncompressed AIFF file, without reading the audio itself.
+ *
+ * @returns OP1_ARGUMENT_ERROR if `data` is not a FORM container, OP1_ERROR if
+ * it is truncated, compressed, or has no COMM or SSND chunk, OP1_SUCCESS
+ * otherwise.
+ */
+int aiff_read(const uint8_t * data, size_t size, aiff_contents * contents);
+
+#endif // OP1_AIFF_H
@@ -0,0 +1,62 @@
+#include "op1.h"
+#include "op1_alloc.h"
+
+using namespace std;
+
+namespace {
+void * default_allocate(size_t size, void * user_data)
+{
+  return malloc(size ? size : 1);
+}
+
+void default_deallocate(void * p, void * user_data)
+{
+  free(p);
+}
+
+op1_allocator g_allocator = { default_allocate, default_deallocate, nullptr };
+// Memory handed out by `g_allocator` and not freed yet, that the next one
+// would not know how to free.
+atomic<size_t> g_live_allocations(0);
+}
+
+void * op1_allocate(size_t size)
+{
+  void * p = g_allocator.allocate(size, g_allocator.user_data);
+  if (p) {
+    g_live_allocations.fetch_add(1, memory_order_relaxed);
+  }
+  return p;
+}
+
+void op1_deallocate(void * p)
+{
+  if (!p) {
+    return;
+  }
+  g_allocator.deallocate(p, g_allocator.user_data);
+  g_live_allocations.fetch_sub(1, memory_order_relaxed);
+}
+
+int op1_set_allocator(const op1_allocator * allocator)
+{
+  if (allocator && (!allocator->allocate || !allocator->deallocate)) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  if (g_live_allocations.load(memory_order_relaxed)) {
+    LOG_ERROR("%zu allocations are still in use, can't change the allocator.",
+              g_live_allocations.load(memory_order_relaxed));
+    return OP1_ERROR;
+  }
+
+  if (allocator) {
+    g_allocator = *allocator;
+  } else {
+    g_allocator.allocate = default_allocate;
+    g_allocator.deallocate = default_deallocate;
+    g_allocator.user_data = nullptr;
+  }
+
+  return OP1_SUCCESS;
+}
@@ -0,0 +1,107 @@
+#ifndef OP1_ALLOC_H
+#define OP1_ALLOC_H
+
+/** @file
+ *     Routing of the memory of the library through the allocator set with
+ *     `op1_set_allocator`. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <new>
+#include <vector>
+
+/**
+ * Allocate `size` bytes with the allocator of the library.
+ *
+ * @returns the memory, or null if it could not be allocated.
+ */
+void * op1_allocate(size_t size);
+
+/**
+ * Free memory returned by `op1_allocate`. Does nothing for null.
+ */
+void op1_deallocate(void * p);
+
+/**
+ * A standard allocator over `op1_allocate`, for the containers of the
+ * library. Throws `std::bad_alloc` like the default one, which the API
+ * functions turn into `OP1_ERROR`.
+ */
+template<typename T>
+struct op1_stl_allocator
+{
+  typedef T value_type;
+
+  op1_stl_allocator() {}
+  template<typename U>
+  op1_stl_allocator(const op1_stl_allocator<U> &) {}
+
+  T * allocate(size_t n)
+  {
+    if (n > SIZE_MAX / sizeof(T)) {
+      throw std::bad_alloc();
+    }
+    void * p = op1_allocate(n * sizeof(T));
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T * p, size_t n)
+  {
+    op1_deallocate(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const op1_stl_allocator<T> &, const op1_stl_allocator<U> &)
+{
+  return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const op1_stl_allocator<T> &, const op1_stl_allocator<U> &)
+{
+  return false;
+}
+
+template<typename T>
+using op1_vector = std::vector<T, op1_stl_allocator<T>>;
+
+template<typename T>
+using op1_list = std::list<T, op1_stl_allocator<T>>;
+
+/**
+ * Base of the objects the library allocates with `new`, so that they use the
+ * allocator of the library as well.
+ */
+struct op1_allocated
+{
+  static void * operator new(size_t size)
+  {
+    void * p = op1_allocate(size);
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+
+  static void * operator new(size_t size, const std::nothrow_t &) noexcept
+  {
+    return op1_allocate(size);
+  }
+
+  static void operator delete(void * p) noexcept
+  {
+    op1_deallocate(p);
+  }
+
+  static void operator delete(void * p, const std::nothrow_t &) noexcept
+  {
+    op1_deallocate(p);
+  }
+};
+
+#endif // OP1_ALLOC_H
@@ -0,0 +1,106 @@
+#include <cassert>
+#include <cstring>
+
+#include "op1_appl.h"
+
+namespace {
+
+char * write_text(char * out, const char * text)
+{
+  size_t length = strlen(text);
+  memcpy(out, text, length);
+  return out + length;
+}
+
+char * write_unsigned(char * out, uint64_t value)
+{
+  char digits[20];
+  size_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count) {
+    *out++ = digits[--count];
+  }
+  return out;
+}
+
+char * write_int(char * out, int64_t value)
+{
+  if (value < 0) {
+    *out++ = '-';
+    return write_unsigned(out, -static_cast<uint64_t>(value));
+  }
+  return write_unsigned(out, value);
+}
+
+// Write `,"key":`, for any key but the first one.
+char * write_key(char * out, const char * key)
+{
+  *out++ = ',';
+  *out++ = '"';
+  out = write_text(out, key);
+  *out++ = '"';
+  *out++ = ':';
+  return out;
+}
+
+template<typename T, size_t N>
+char * write_array(char * out, const char * key, const std::array<T, N> & values)
+{
+  out = write_key(out, key);
+  *out++ = '[';
+  for (size_t i = 0; i < N; i++) {
+    if (i) {
+      *out++ = ',';
+    }
+    out = write_int(out, values[i]);
+  }
+  *out++ = ']';
+  return out;
+}
+
+char * write_number(char * out, const char * key, int64_t value)
+{
+  return write_int(write_key(out, key), value);
+}
+
+char * write_string(char * out, const char * key, const char * value)
+{
+  out = write_key(out, key);
+  *out++ = '"';
+  out = write_text(out, value);
+  *out++ = '"';
+  return out;
+}
+}
+
+size_t appl_write_drum(const drum_appl & appl, char * out)
+{
+  char * start = out;
+
+  // keys in the order of nlohmann::json, sorted
+  out = write_text(out, "{\"drum_version\":1");
+  out = write_array(out, "dyna_env", appl.enveloppe);
+  out = write_array(out, "end", appl.end);
+  out = write_number(out, "fx_active", appl.fx_active);
+  out = write_array(out, "fx_params", appl.fx_params);
+  out = write_string(out, "fx_type", appl.fx_type);
+  out = write_number(out, "lfo_active", appl.lfo_active);
+  out = write_array(out, "lfo_params", appl.lfo_params);
+  out = write_string(out, "lfo_type", appl.lfo_type);
+  out = write_string(out, "name", "user");
+  out = write_number(out, "octave", 0);
+  out = write_array(out, "pitch", appl.pitches);
+  out = write_array(out, "playmode", appl.playmode);
+  out = write_array(out, "reverse", appl.playback_direction);
+  out = write_array(out, "start", appl.start);
+  out = write_string(out, "type", "drum");
+  out = write_array(out, "volume", appl.volumes);
+  *out++ = '}';
+
+  assert(static_cast<size_t>(out - start) <= DRUM_APPL_CAPACITY);
+
+  return out - start;
+}
@@ -0,0 +1,49 @@
+#ifndef OP1_APPL_H
+#define OP1_APPL_H
+
+/** @file
+ *     Serializer for the JSON document of the APPL chunk of a drum kit. The
+ *     layout is fixed, so it is written directly, in the order and format
+ *     `nlohmann::json::dump` gives. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+
+/**
+ * The largest document `appl_write_drum` can write, with every value as long
+ * as it can be.
+ */
+const size_t DRUM_APPL_CAPACITY = 4096;
+
+/**
+ * The values of the JSON document of a drum kit. Start and end times are in
+ * OP-1 time units.
+ */
+struct drum_appl
+{
+  std::array<int, 8> enveloppe;
+  std::array<uint64_t, 24> end;
+  int fx_active;
+  std::array<int, 8> fx_params;
+  const char * fx_type;
+  int lfo_active;
+  std::array<int, 8> lfo_params;
+  const char * lfo_type;
+  std::array<int, 24> pitches;
+  std::array<int, 24> playmode;
+  std::array<int, 24> playback_direction;
+  std::array<uint64_t, 24> start;
+  std::array<int, 24> volumes;
+};
+
+/**
+ * Write the JSON document of `appl` at `out`, that has to be at least
+ * `DRUM_APPL_CAPACITY` bytes long. `fx_type` and `lfo_type` are written as is,
+ * and must not need escaping.
+ *
+ * @returns the length of the document, that is not null-terminated.
+ */
+size_t appl_write_drum(const drum_appl & appl, char * out);
+
+#endif // OP1_APPL_H
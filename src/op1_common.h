@@ -1,20 +1,50 @@
 #ifndef OP1_COMMON_H
 #define OP1_COMMON_H
 
-extern bool g_logging_enabled;
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iterator>
 
+// The most detailed `OP1_LOG_LEVEL` passed to the log callback, set by
+// `op1_set_log_callback`.
+extern std::atomic<int> g_log_level;
+
+// Format a message and pass it to the log callback.
+void op1_log(int level, const char * file, int line, const char * format, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 4, 5)))
+#endif
+  ;
+
 #define OP1_MACRO_BEGIN do {
 #define OP1_MACRO_END } while (0)
 
-#define LOG(...)                                       \
-    OP1_MACRO_BEGIN                                    \
-    if (g_logging_enabled) {                           \
-      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);  \
-      fprintf(stderr, __VA_ARGS__);                    \
-    }                                                  \
+// With OP1_NO_LOGGING, the messages are still checked by the compiler, but
+// the code is removed.
+#ifdef OP1_NO_LOGGING
+#define OP1_LOG_ENABLED(level) false
+#else
+#define OP1_LOG_ENABLED(level) \
+  ((level) <= g_log_level.load(std::memory_order_relaxed))
+#endif
+
+#define LOG_AT(level, ...)                              \
+    OP1_MACRO_BEGIN                                     \
+    if (OP1_LOG_ENABLED(level)) {                       \
+      op1_log((level), __FILE__, __LINE__, __VA_ARGS__); \
+    }                                                   \
     OP1_MACRO_END
 
+// Messages of the library, see `OP1_LOG_LEVEL`. The tools print directly with
+// `WARN` and `FATAL`.
+#define LOG(...) LOG_AT(OP1_LOG_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(OP1_LOG_INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(OP1_LOG_WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(OP1_LOG_ERROR, __VA_ARGS__)
+
 #define FATAL(str)                       \
   OP1_MACRO_BEGIN                        \
   fprintf(stderr, "Fatal: %s\n", (str)); \
@@ -34,14 +64,14 @@ extern bool g_logging_enabled;
   OP1_MACRO_END
 
 template<typename T>
-void PodZero(T blob)
+void PodZero(T & blob)
 {
   memset(&blob, 0, sizeof(T));
 }
 
 
 template<typename T, size_t S>
-void ArrayCopy(std::array<T, S> lhs, T rhs[S])
+void ArrayCopy(std::array<T, S> & lhs, const T rhs[S])
 {
   for (size_t i = 0; i < S; i++) {
     lhs[i] = rhs[i];
@@ -1,25 +1,77 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstring>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unistd.h>
 #include "sndfile.h"
 #include "json.hpp"
 
 #include "op1.h"
+#include "op1_aiff.h"
+#include "op1_alloc.h"
+#include "op1_appl.h"
+#include "op1_dsp.h"
+#include "op1_mmap.h"
+#include "op1_resample.h"
+#include "op1_thread_pool.h"
 
 using json = nlohmann::json;
 using namespace std;
 
-bool g_logging_enabled;
-
 namespace {
+// Adds the time spent in its scope to a duration of `op1_stats`.
+class phase_timer
+{
+public:
+  explicit phase_timer(uint64_t * total)
+    : m_total(total)
+    , m_start(chrono::steady_clock::now())
+  {
+  }
+
+  ~phase_timer()
+  {
+    auto elapsed = chrono::steady_clock::now() - m_start;
+    *m_total += chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+  }
+
+private:
+  uint64_t * m_total;
+  chrono::steady_clock::time_point m_start;
+};
+
+// Run `fn`, turning a failed allocation into an error code, so that it does
+// not escape the C API.
+template<typename F>
+int catch_allocation_failure(F fn)
+{
+  try {
+    return fn();
+  } catch (bad_alloc &) {
+    LOG_ERROR("Out of memory.");
+    return OP1_ERROR;
+  }
+}
 
+
+// A read-only view over memory owned by the caller, for libsndfile.
 struct vio_data {
   size_t offset;
-  vector<uint8_t> data;
+  const uint8_t * data;
+  size_t length;
 };
 
 sf_count_t vf_get_filelen(void * user_ptr)
 {
   vio_data * vio = reinterpret_cast<vio_data*>(user_ptr);
-  return vio->data.size();
+  return vio->length;
 }
 
 sf_count_t vf_seek(sf_count_t offset, int whence, void * user_ptr)
@@ -34,7 +86,7 @@ sf_count_t vf_seek(sf_count_t offset, int whence, void * user_ptr)
       vio->offset = vio->offset + offset ;
       break;
     case SEEK_END :
-      vio->offset = vio->data.size() + offset ;
+      vio->offset = vio->length + offset ;
       break;
     default:
       break;
@@ -47,11 +99,15 @@ sf_count_t vf_read(void * ptr, sf_count_t count, void * user_ptr)
 {
   vio_data * vio = reinterpret_cast<vio_data*>(user_ptr);
 
-  if (vio->offset + count > vio->data.size()) {
-    count = vio->data.size() - vio->offset;
+  if (vio->offset >= vio->length) {
+    return 0;
   }
 
-  memcpy (ptr, vio->data.data() + vio->offset, count);
+  if (vio->offset + count > vio->length) {
+    count = vio->length - vio->offset;
+  }
+
+  memcpy (ptr, vio->data + vio->offset, count);
   vio->offset += count;
 
   return count ;
@@ -59,16 +115,8 @@ sf_count_t vf_read(void * ptr, sf_count_t count, void * user_ptr)
 
 sf_count_t vf_write (const void * ptr, sf_count_t count, void * user_ptr)
 {
-  vio_data * vio = reinterpret_cast<vio_data*>(user_ptr);
-
-  if (vio->offset + count > vio->data.size()) {
-    vio->data.resize(vio->offset + count);
-  }
-
-  memcpy (vio->data.data() + vio->offset, ptr, count) ;
-  vio->offset += count;
-
-  return count;
+  // the input buffer is not ours to modify
+  return 0;
 }
 
 sf_count_t vf_tell (void * user_ptr)
@@ -78,23 +126,310 @@ sf_count_t vf_tell (void * user_ptr)
   return vio->offset;
 }
 
+
+// Where the audio of a kit read by `op1_drum_load` lives until it is decoded:
+// the mapped file, or a copy of the part of the caller's buffer it is in.
+struct pcm_source : op1_allocated
+{
+  mapped_file mapping;
+  op1_vector<uint8_t> copy;
+};
 }
 
 
-struct audio_file
+// Samples are reference counted, so that any number of drum contexts can
+// use the same decoded audio without copying it.
+struct audio_file : op1_allocated
 {
   audio_file()
+    : refs(1)
+    , exact16(false)
+    , generation(0)
+    , data_exposed(false)
+    , pcm(nullptr)
+    , view_start(0)
+    , view_length(0)
+    , gain(1.0f)
+    , normalize_mode(OP1_NORMALIZE_NONE)
+    , normalize_target_db(0.0f)
+    , levels_known(false)
+    , peak(0.0f)
+    , energy(0.0)
   {
     PodZero(info);
+    PodZero(stats);
   }
 
+  atomic<int> refs;
   SF_INFO info;
-  vector<int16_t> data;
+  // Mono audio, in [-1.0, 1.0). It is only quantized to 16-bit on export.
+  op1_vector<float> data;
+  // Whether every value in `data` is exactly representable in 16-bit, in
+  // which case it is exported without dither.
+  bool exact16;
+  // Bumped when what the sample sounds like changes, so that drum contexts
+  // know when the audio they have encoded is stale.
+  uint64_t generation;
+  // Whether the caller has a pointer into `data`, and can change it at any
+  // time: exports of this sample are never reused.
+  bool data_exposed;
+  // For samples read from an OP-1 file, the big-endian 16-bit audio `data` is
+  // decoded from, the first time it is needed. While the sample is exact, it
+  // is copied as is on export.
+  const uint8_t * pcm;
+  unique_ptr<pcm_source> source;
+  once_flag decode_once;
+  // The part of `data` that is used, set by `op1_sample_trim`.
+  size_t view_start;
+  size_t view_length;
+  // Set by `op1_sample_normalize`, applied when quantizing.
+  float gain;
+  int normalize_mode;
+  float normalize_target_db;
+  // Levels of the view, measured while decoding.
+  bool levels_known;
+  float peak;
+  double energy;
+  // 16-bit copy of `data`, made on request by `op1_sample_get_data`.
+  op1_vector<int16_t> pcm16;
+  op1_stats stats;
+};
+
+namespace {
+void sample_retain(audio_file * sample)
+{
+  sample->refs.fetch_add(1, memory_order_relaxed);
+}
+
+void sample_release(audio_file * sample)
+{
+  if (sample->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+    delete sample;
+  }
+}
+
+// A new sample with the same audio and settings as `sample`, which has been
+// decoded.
+audio_file * sample_copy(const audio_file * sample)
+{
+  unique_ptr<audio_file> copy(new audio_file);
+
+  copy->info = sample->info;
+  copy->data = sample->data;
+  copy->exact16 = sample->exact16;
+  copy->view_start = sample->view_start;
+  copy->view_length = sample->view_length;
+  copy->gain = sample->gain;
+  copy->normalize_mode = sample->normalize_mode;
+  copy->normalize_target_db = sample->normalize_target_db;
+  copy->levels_known = sample->levels_known;
+  copy->peak = sample->peak;
+  copy->energy = sample->energy;
+  copy->stats.allocations = 1;
+  copy->stats.bytes_out = copy->data.size() * sizeof(float);
+
+  return copy.release();
+}
+
+const float * sample_frames(const audio_file * sample)
+{
+  return sample->data.data() + sample->view_start;
+}
+
+size_t sample_length(const audio_file * sample)
+{
+  return sample->view_length;
+}
+
+// Whether `sample` is exported as is, with no need for dither.
+bool sample_is_exact16(const audio_file * sample)
+{
+  return sample->exact16 && sample->gain == 1.0f;
+}
+
+// Decode the audio of a sample read from an OP-1 file, if it has not been
+// already. Other samples are decoded when they are loaded.
+void sample_decode(audio_file * sample)
+{
+  if (!sample->pcm) {
+    return;
+  }
+
+  call_once(sample->decode_once, [sample]() {
+    phase_timer timer(&sample->stats.decode_ns);
+    const size_t BLOCK_FRAMES = 4096;
+    int16_t block[BLOCK_FRAMES];
+    size_t count = sample->info.frames;
+    const uint8_t * in = sample->pcm;
+
+    sample->data.resize(count);
+    for (size_t offset = 0; offset < count; offset += BLOCK_FRAMES) {
+      size_t n = min(BLOCK_FRAMES, count - offset);
+      for (size_t i = 0; i < n; i++, in += 2) {
+        block[i] = static_cast<int16_t>((in[0] << 8) | in[1]);
+      }
+      dsp_int16_to_float(block, sample->data.data() + offset, n);
+    }
+
+    sample->stats.allocations++;
+    sample->stats.bytes_in = count * sizeof(int16_t);
+    sample->stats.bytes_out = count * sizeof(float);
+
+    LOG("decoded %zu frames\n", count);
+  });
+}
+
+void measure_levels(audio_file * sample)
+{
+  sample_decode(sample);
+  sample->peak = 0.0f;
+  sample->energy = 0.0;
+  dsp_levels(sample_frames(sample), sample_length(sample), &sample->peak,
+             &sample->energy);
+  sample->levels_known = true;
+}
+
+int normalize(audio_file * sample, int mode, float target_db)
+{
+  if (mode < OP1_NORMALIZE_NONE || mode > OP1_NORMALIZE_RMS ||
+      !std::isfinite(target_db)) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  sample->gain = 1.0f;
+  sample->generation++;
+  sample->normalize_mode = mode;
+  sample->normalize_target_db = target_db;
+
+  if (mode == OP1_NORMALIZE_NONE || !sample_length(sample)) {
+    return OP1_SUCCESS;
+  }
+
+  if (!sample->levels_known) {
+    measure_levels(sample);
+  }
+
+  double level = sample->peak;
+  if (mode == OP1_NORMALIZE_RMS) {
+    level = sqrt(sample->energy / sample_length(sample));
+  }
+
+  // nothing to bring up
+  if (level == 0.0) {
+    return OP1_SUCCESS;
+  }
+
+  sample->gain = pow(10.0, target_db / 20.0) / level;
+
+  LOG("normalized: level %f, gain %f\n", level, sample->gain);
+
+  return OP1_SUCCESS;
+}
+
+size_t milliseconds_to_frames(float milliseconds, int rate)
+{
+  return lrint(milliseconds * rate / 1000.0);
+}
+
+bool valid_trim_options(const op1_trim_options & options)
+{
+  return std::isfinite(options.threshold_db) &&
+         std::isfinite(options.hold_ms) && options.hold_ms >= 0.0f &&
+         std::isfinite(options.pre_roll_ms) && options.pre_roll_ms >= 0.0f;
+}
+
+int trim(audio_file * sample, const op1_trim_options & options)
+{
+  if (!valid_trim_options(options)) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  sample_decode(sample);
+
+  const float * data = sample->data.data();
+  size_t count = sample->data.size();
+  float threshold = pow(10.0, options.threshold_db / 20.0);
+
+  size_t first = dsp_find_first_above(data, count, threshold);
+  size_t start = 0;
+  size_t end = count;
+
+  if (first != count) {
+    size_t last = dsp_find_last_above(data, count, threshold);
+    int rate = sample->info.samplerate;
+    size_t pre_roll = milliseconds_to_frames(options.pre_roll_ms, rate);
+    size_t hold = milliseconds_to_frames(options.hold_ms, rate);
+
+    start = first > pre_roll ? first - pre_roll : 0;
+    end = min(count, last + 1 + hold);
+  }
+
+  LOG("trimmed to [%zu, %zu) of %zu frames\n", start, end, count);
+
+  sample->view_start = start;
+  sample->view_length = end - start;
+  sample->levels_known = false;
+
+  // the levels of what is kept have changed
+  return normalize(sample, sample->normalize_mode, sample->normalize_target_db);
+}
+}
+
+// How a sample is used by a drum kit, set by `op1_drum_fit`.
+struct slot_fit
+{
+  slot_fit()
+    : length(SIZE_MAX)
+    , fade_out(0)
+    , speed(1.0f)
+  {}
+
+  // Frames used from the start of the sample, all of them by default.
+  size_t length;
+  // Frames faded out at the end of the slot.
+  size_t fade_out;
+  // A sped up copy of the sample, used instead of it when not empty.
+  op1_vector<float> compressed;
+  float speed;
+
+  // Back to using the whole sample. Keeps the memory of `compressed`.
+  void reset()
+  {
+    length = SIZE_MAX;
+    fade_out = 0;
+    compressed.clear();
+    speed = 1.0f;
+  }
+};
+
+// The audio of one slot of a drum kit, as it is written.
+struct export_slot
+{
+  const audio_file * sample;
+  const float * frames;
+  // The audio of the file the sample was read from, copied as is when not
+  // null.
+  const uint8_t * pcm;
+  size_t length;
+  size_t fade_out;
 };
 
-struct op1_drum
+struct op1_drum : op1_allocated
 {
   op1_drum()
+  {
+    set_defaults();
+    audio_generation = 0;
+    encoded_generation = UINT64_MAX;
+    PodZero(stats);
+  }
+
+  ~op1_drum()
+  {
+    release_samples();
+  }
+
+  void set_defaults()
   {
     end_times.fill(0);
     enveloppe = {{ 0, 8192, 0, 8192, 0, 0, 0, 0 }};
@@ -107,9 +442,31 @@ struct op1_drum
     volumes.fill(OP1_VOLUME_FLAT);
     fx_type = "cwo";
     lfo_type = "element";
+    fx_active = 0;
+    lfo_active = 0;
+    dither = OP1_DITHER_TPDF;
   }
 
-  vector<audio_file> audio_samples;
+  void release_samples()
+  {
+    for (uint32_t i = 0; i < audio_samples.size(); i++) {
+      sample_release(audio_samples[i]);
+    }
+  }
+
+  // Back to using the whole samples, which does not allocate.
+  void reset_fits()
+  {
+    for (size_t i = 0; i < fits.size(); i++) {
+      fits[i].reset();
+    }
+  }
+
+  // Each of those holds a reference.
+  op1_vector<audio_file*> audio_samples;
+  // One for each sample, and those of the samples released by
+  // `op1_drum_reset`, kept for their memory and reused by the next samples.
+  op1_vector<slot_fit> fits;
 
   array<int, 24> end_times;
   array<int, 24> pitches;
@@ -126,545 +483,2363 @@ struct op1_drum
 
   int fx_active;
   int lfo_active;
+
+  int dither;
+
+  // Bumped when the samples, how they fit, or how they are quantized change.
+  uint64_t audio_generation;
+  // The SSND payload of the last export to memory, reused while neither this
+  // context nor its samples have changed, so that changing parameters only
+  // costs the header. Streamed exports use it when it is current, but don't
+  // make it, to keep their memory bounded.
+  op1_vector<uint8_t> encoded;
+  uint64_t encoded_generation;
+  // The generation of each sample when `encoded` was made.
+  op1_vector<uint64_t> encoded_sample_generations;
+
+  // Scratch space of the exports, kept from one to the next, and across
+  // `op1_drum_reset`, so that exporting again allocates nothing.
+  op1_vector<export_slot> export_slots;
+  op1_vector<uint8_t> header;
+
+  op1_stats stats;
 };
 
 namespace {
+// The largest start or end marker the OP-1 accepts.
+const uint64_t OP1_DRUMKIT_END = 0x7FFFFFFE;
+// Maximum amount of data for a drum sample on an op-1
+const uint64_t BYTES_IN_12_SECS = 44100 * 2 * 12;
+// OP-1 time units in a frame, 4056.
+const uint64_t OP1_TIME_PER_FRAME =
+  OP1_DRUMKIT_END / BYTES_IN_12_SECS * sizeof(uint16_t);
+
+// The markers computed for a kit end at most at its last frame.
+static_assert(OP1_DRUM_MAX_FRAMES * OP1_TIME_PER_FRAME <= OP1_DRUMKIT_END,
+              "the end marker of the longest kit is out of range");
+
+uint64_t op1_time_per_frame()
+{
+  return OP1_TIME_PER_FRAME;
+}
+
 uint64_t frame_to_op1_time(uint64_t frame)
 {
-  // Maximum amount of data for a drum sample on an op-1
-  const int BYTES_IN_12_SECS = 44100 * 2 * 12;
-  const int OP1_DRUMKIT_END = 0x7FFFFFFE;
-  return OP1_DRUMKIT_END / BYTES_IN_12_SECS * frame * sizeof(uint16_t);
+  return op1_time_per_frame() * frame;
 }
+
+// The inverse of `frame_to_op1_time`, rounding to the nearest frame for times
+// written by other tools.
+uint64_t op1_time_to_frame(uint64_t time)
+{
+  return (time + op1_time_per_frame() / 2) / op1_time_per_frame();
 }
 
+const char * FX_TYPES[] = {
+  "cwo", "delay", "grid", "nitro", "phone", "punch", "spring"
+};
 
-int op1_sample_load(const char * file_name, audio_file ** sample)
+const char * LFO_TYPES[] = {
+  "bend", "crank", "element", "midi", "random", "tremolo", "value"
+};
+
+// The entry of `names` that is `name`, or null.
+template<size_t N>
+const char * find_type(const char * (&names)[N], const char * name)
 {
-  SF_INFO info;
+  for (size_t i = 0; i < N; i++) {
+    if (!strcmp(names[i], name)) {
+      return names[i];
+    }
+  }
+  return nullptr;
+}
+}
 
-  ENSURE_VALID(file_name);
-  ENSURE_VALID(sample);
 
-  *sample = new audio_file;
+namespace {
+// Convert `sample` to the OP-1 rate.
+int convert_rate(audio_file * sample, int quality)
+{
+  phase_timer timer(&sample->stats.convert_ns);
+  op1_vector<float> converted;
+
+  int rv = resample(sample->data.data(), sample->data.size(),
+                    sample->info.samplerate, OP1_SAMPLE_RATE, quality,
+                    converted);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
 
-  PodZero(info);
+  LOG("converted from %d to %d Hz: %zu frames\n", sample->info.samplerate,
+      OP1_SAMPLE_RATE, converted.size());
 
-  SNDFILE* file = sf_open(file_name, SFM_READ, &info);
-  if (!file) {
-    return OP1_ERROR;
-  }
+  sample->data.swap(converted);
+  sample->stats.allocations++;
+  sample->info.samplerate = OP1_SAMPLE_RATE;
+  sample->info.frames = sample->data.size();
+  sample->exact16 = false;
+  sample->levels_known = false;
 
-  LOG("%s - rate: %d - frame count: %lld\n", file_name, info.samplerate, info.frames);
+  return OP1_SUCCESS;
+}
 
-  size_t samples = info.frames * info.channels;
-  (*sample)->info = info;
-  (*sample)->data.resize(samples);
+// Number of frames decoded at once.
+const size_t DECODE_BLOCK_FRAMES = 4096;
 
-  sf_count_t count = sf_read_short(file, (*sample)->data.data(), info.frames);
-  if (count != info.frames) {
-    WARN("Unexpected number of frames.");
+void downmix(const float * in, int channels, int policy, float * out,
+             size_t frame_count)
+{
+  switch (policy) {
+    case OP1_DOWNMIX_LEFT:
+      dsp_extract_channel(in, channels, 0, out, frame_count);
+      break;
+    case OP1_DOWNMIX_RIGHT:
+      dsp_extract_channel(in, channels, min(1, channels - 1), out, frame_count);
+      break;
+    case OP1_DOWNMIX_MID:
+      dsp_downmix_mid(in, channels, out, frame_count);
+      break;
+    default:
+      dsp_downmix_average(in, channels, out, frame_count);
+      break;
   }
+}
 
-  int rv = sf_close(file);
-  if (rv != 0) {
-    return OP1_ERROR;
+// Decode every frame of `file`, and convert them to mono while decoding,
+// measuring the levels of each block while it is hot.
+void decode_mono(SNDFILE * file, int channels, int policy, audio_file * sample)
+{
+  op1_vector<float> & data = sample->data;
+  op1_vector<float> block(DECODE_BLOCK_FRAMES * channels);
+
+  for (;;) {
+    sf_count_t count = sf_readf_float(file, block.data(), DECODE_BLOCK_FRAMES);
+    if (count <= 0) {
+      break;
+    }
+    size_t offset = data.size();
+    data.resize(offset + count);
+    downmix(block.data(), channels, policy, data.data() + offset, count);
+    dsp_levels(data.data() + offset, count, &sample->peak, &sample->energy);
   }
 
-  return OP1_SUCCESS;
+  sample->levels_known = true;
 }
 
-int op1_sample_load_buffer(const uint8_t * data, size_t length, audio_file ** sample)
+// Decode every frame of `file`, and keep the channel with the most energy.
+void decode_loudest_channel(SNDFILE * file, int channels, audio_file * sample)
 {
-  SF_INFO info;
+  op1_vector<float> & data = sample->data;
+  op1_vector<float> interleaved;
+  op1_vector<double> energies(channels, 0.0);
+
+  for (;;) {
+    size_t offset = interleaved.size();
+    interleaved.resize(offset + DECODE_BLOCK_FRAMES * channels);
+    sf_count_t count = sf_readf_float(file, interleaved.data() + offset,
+                                      DECODE_BLOCK_FRAMES);
+    interleaved.resize(offset + max<sf_count_t>(count, 0) * channels);
+    if (count <= 0) {
+      break;
+    }
+    dsp_channel_energies(interleaved.data() + offset, channels, count,
+                         energies.data());
+  }
 
-  ENSURE_VALID(data);
-  ENSURE_VALID(sample);
+  int loudest = max_element(energies.begin(), energies.end()) - energies.begin();
 
-  SF_VIRTUAL_IO vio ;
-  vio.get_filelen = vf_get_filelen ;
-  vio.seek = vf_seek ;
-  vio.read = vf_read ;
-  vio.write = vf_write ;
-  vio.tell = vf_tell ;
+  LOG("loudest channel: %d\n", loudest);
 
-  *sample = new audio_file;
+  data.resize(interleaved.size() / channels);
+  dsp_extract_channel(interleaved.data(), channels, loudest, data.data(),
+                      data.size());
+  measure_levels(sample);
+}
 
-  PodZero(info);
+// Whether decoding a file in `format` with `policy` gives values that are
+// exactly representable in 16-bit.
+bool decodes_to_exact16(int format, int channels, int policy)
+{
+  switch (format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_S8:
+    case SF_FORMAT_PCM_U8:
+    case SF_FORMAT_PCM_16:
+      // averaging channels adds bits
+      return channels == 1 || policy == OP1_DOWNMIX_LEFT ||
+             policy == OP1_DOWNMIX_RIGHT || policy == OP1_DOWNMIX_MAX_ENERGY;
+    default:
+      return false;
+  }
+}
 
-  vio_data vdata;
-  vdata.offset = 0;
-  vdata.data = vector<uint8_t>(data, data + length);
+// Decode all the audio of `file` into a new mono `audio_file`, and close
+// `file`.
+int decode_and_close(SNDFILE * file, const SF_INFO & info,
+                     const op1_sample_options & options, audio_file ** sample)
+{
+  unique_ptr<audio_file> decoded;
 
-  SNDFILE* file = sf_open_virtual (&vio, SFM_READ, &info, &vdata);
-  if (!file) {
-    return OP1_ERROR;
-  }
+  try {
+    decoded.reset(new audio_file);
+    decoded->info = info;
 
-  LOG("Buffer(%p) - rate: %d - frame count: %lld\n", data, info.samplerate, info.frames);
+    phase_timer timer(&decoded->stats.decode_ns);
+    if (info.frames > 0) {
+      decoded->data.reserve(info.frames);
+    }
+    decoded->stats.allocations++;
 
-  size_t samples = info.frames * info.channels;
-  (*sample)->info = info;
-  (*sample)->data.resize(samples);
+    if (options.downmix == OP1_DOWNMIX_MAX_ENERGY && info.channels > 1) {
+      decode_loudest_channel(file, info.channels, decoded.get());
+    } else {
+      decode_mono(file, info.channels, options.downmix, decoded.get());
+    }
+  } catch (...) {
+    sf_close(file);
+    throw;
+  }
 
-  sf_count_t count = sf_read_short(file, (*sample)->data.data(), info.frames);
-  if (count != info.frames) {
-    WARN("Unexpected number of frames.");
+  if (static_cast<sf_count_t>(decoded->data.size()) != info.frames) {
+    LOG_WARNING("Unexpected number of frames.");
   }
 
+  decoded->info.channels = 1;
+  decoded->info.frames = decoded->data.size();
+  decoded->exact16 = decodes_to_exact16(info.format, info.channels,
+                                        options.downmix);
+
   int rv = sf_close(file);
   if (rv != 0) {
     return OP1_ERROR;
   }
 
-  return OP1_SUCCESS;
-}
+  if (options.resample_quality != OP1_RESAMPLE_NONE &&
+      info.samplerate != OP1_SAMPLE_RATE && !decoded->data.empty()) {
+    rv = convert_rate(decoded.get(), options.resample_quality);
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+  }
 
-int op1_sample_get_data(audio_file * sample, int16_t ** data, size_t * frame_count)
-{
-  ENSURE_VALID(sample);
-  ENSURE_VALID(data);
-  ENSURE_VALID(frame_count);
+  decoded->view_start = 0;
+  decoded->view_length = decoded->data.size();
 
-  if (!sample->data.size()) {
-    return OP1_ERROR;
+  if (options.trim) {
+    rv = trim(decoded.get(), options.trim_options);
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+  }
+
+  rv = normalize(decoded.get(), options.normalize, options.normalize_target_db);
+  if (rv != OP1_SUCCESS) {
+    return rv;
   }
 
-  *data = sample->data.data();
-  *frame_count = sample->data.size();
+  decoded->stats.bytes_out = decoded->data.size() * sizeof(float);
+  *sample = decoded.release();
 
   return OP1_SUCCESS;
 }
 
-int op1_sample_get_length(audio_file * sample, size_t * frame_count)
+uint64_t rotate_left(uint64_t x, int bits)
 {
-  ENSURE_VALID(sample);
-  ENSURE_VALID(frame_count);
+  return (x << bits) | (x >> (64 - bits));
+}
 
-  if (!sample->data.size()) {
-    return OP1_ERROR;
+uint64_t mix_bits(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+// MurmurHash3 x64 128 of `length` bytes, with a seed of 0, in `digest`.
+// Content is only compared through it, two different files having the same
+// one is unlikely enough.
+void content_digest(const uint8_t * data, size_t length, uint64_t digest[2])
+{
+  const uint64_t C1 = 0x87c37b91114253d5ull;
+  const uint64_t C2 = 0x4cf5ad432745937full;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+  size_t i = 0;
+
+  for (; i + 16 <= length; i += 16) {
+    uint64_t k1, k2;
+    memcpy(&k1, data + i, 8);
+    memcpy(&k2, data + i + 8, 8);
+
+    h1 ^= rotate_left(k1 * C1, 31) * C2;
+    h1 = (rotate_left(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= rotate_left(k2 * C2, 33) * C1;
+    h2 = (rotate_left(h2, 31) + h1) * 5 + 0x38495ab5;
   }
 
-  *frame_count = sample->data.size();
+  // the last 15 bytes at most, little-endian
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t j = 0; i + j < length; j++) {
+    if (j < 8) {
+      k1 |= uint64_t(data[i + j]) << (8 * j);
+    } else {
+      k2 |= uint64_t(data[i + j]) << (8 * (j - 8));
+    }
+  }
+  if (length - i > 8) {
+    h2 ^= rotate_left(k2 * C2, 33) * C1;
+  }
+  if (length - i > 0) {
+    h1 ^= rotate_left(k1 * C1, 31) * C2;
+  }
 
-  return OP1_SUCCESS;
+  h1 ^= length;
+  h2 ^= length;
+  h1 += h2;
+  h2 += h1;
+  h1 = mix_bits(h1);
+  h2 = mix_bits(h2);
+  h1 += h2;
+  h2 += h1;
+
+  digest[0] = h1;
+  digest[1] = h2;
 }
 
-int op1_sample_get_rate(audio_file * sample, int * rate)
+// What a decoded sample depends on: the content of the file, and how it was
+// decoded.
+struct cache_key
 {
-  ENSURE_VALID(sample);
-  ENSURE_VALID(rate);
+  uint64_t digest[2];
+  size_t length;
+  op1_sample_options options;
+};
 
-  *rate = sample->info.samplerate;
+struct cache_entry
+{
+  cache_key key;
+  // Owned by the cache, and never handed out: callers get copies, that they
+  // can trim or normalize without changing what is cached.
+  audio_file * sample;
+  size_t bytes;
+};
 
-  return OP1_SUCCESS;
+bool same_key(const cache_key & a, const cache_key & b)
+{
+  const op1_sample_options & x = a.options;
+  const op1_sample_options & y = b.options;
+
+  return a.digest[0] == b.digest[0] && a.digest[1] == b.digest[1] &&
+         a.length == b.length &&
+         x.resample_quality == y.resample_quality &&
+         x.downmix == y.downmix && x.normalize == y.normalize &&
+         x.normalize_target_db == y.normalize_target_db &&
+         x.trim == y.trim &&
+         (!x.trim ||
+          (x.trim_options.threshold_db == y.trim_options.threshold_db &&
+           x.trim_options.hold_ms == y.trim_options.hold_ms &&
+           x.trim_options.pre_roll_ms == y.trim_options.pre_roll_ms));
 }
 
-int op1_sample_destroy(audio_file * sample)
+// The decode cache of `op1_sample_cache_enable`. The most recently used
+// samples are at the front of `entries`.
+struct sample_cache
 {
-  delete sample;
+  sample_cache()
+    : enabled(false)
+    , budget(0)
+    , bytes(0)
+    , hits(0)
+    , misses(0)
+    , evictions(0)
+  {}
+
+  // Checked without the lock, so that loads don't contend when the cache is
+  // disabled.
+  atomic<bool> enabled;
+  mutex lock;
+  size_t budget;
+  size_t bytes;
+  typedef op1_list<cache_entry>::iterator entry_iterator;
+  op1_list<cache_entry> entries;
+  unordered_multimap<uint64_t, entry_iterator, hash<uint64_t>,
+                     equal_to<uint64_t>,
+                     op1_stl_allocator<pair<const uint64_t, entry_iterator>>>
+    by_hash;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
 
-  return OP1_SUCCESS;
+sample_cache & decode_cache()
+{
+  static sample_cache cache;
+  return cache;
 }
 
-int op1_drum_init(op1_drum ** ctx)
+// With `cache.lock` held, find the entry for `key`.
+op1_list<cache_entry>::iterator cache_find(sample_cache & cache,
+                                       const cache_key & key)
 {
-  ENSURE_VALID(ctx);
-
-  *ctx = new op1_drum;
-
-  return OP1_SUCCESS;
+  auto range = cache.by_hash.equal_range(key.digest[0]);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (same_key(it->second->key, key)) {
+      return it->second;
+    }
+  }
+  return cache.entries.end();
 }
 
-int op1_drum_destroy(op1_drum * ctx)
+// With `cache.lock` held, drop the least recently used entries until the
+// cache uses at most `budget` bytes. The entries are moved to `dropped`, to be
+// released once the lock is released. Never allocates.
+void cache_shrink(sample_cache & cache, size_t budget,
+                  op1_list<cache_entry> * dropped)
 {
-  ENSURE_VALID(ctx);
-
-  delete ctx;
+  while (cache.bytes > budget) {
+    cache_entry & oldest = cache.entries.back();
+    auto range = cache.by_hash.equal_range(oldest.key.digest[0]);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (&*it->second == &oldest) {
+        cache.by_hash.erase(it);
+        break;
+      }
+    }
+    cache.bytes -= oldest.bytes;
+    dropped->splice(dropped->end(), cache.entries, prev(cache.entries.end()));
+    cache.evictions++;
+  }
+  if (cache.entries.empty()) {
+    // give the buckets back too, so that the allocator can be changed
+    decltype(cache.by_hash)().swap(cache.by_hash);
+  }
+}
 
-  return OP1_SUCCESS;
+void release_all(const op1_list<cache_entry> & entries)
+{
+  for (const cache_entry & entry : entries) {
+    sample_release(entry.sample);
+  }
 }
 
-int op1_drum_write_buffer(op1_drum * ctx, uint8_t ** output, size_t * length)
+// Set `*sample` to a copy of the cached sample for `key`. Returns false if
+// there is none.
+bool cache_lookup(const cache_key & key, audio_file ** sample)
 {
-  ENSURE_VALID(ctx);
-  ENSURE_VALID(output);
-  ENSURE_VALID(length);
-
-  std::array<uint64_t, 24> converted_start;
-  std::array<uint64_t, 24> converted_end;
-
-  bool start_or_end_arrays_set = false;
+  sample_cache & cache = decode_cache();
+  audio_file * cached;
 
-  for (uint32_t i = 0; i < 24; i++) {
-    if (ctx->start_times[i] != 0 || ctx->end_times[i] != 0) {
-      start_or_end_arrays_set = true;
+  {
+    lock_guard<mutex> lock(cache.lock);
+    auto it = cache_find(cache, key);
+    if (it == cache.entries.end()) {
+      cache.misses++;
+      return false;
     }
+    cache.entries.splice(cache.entries.begin(), cache.entries, it);
+    cache.hits++;
+    cached = it->sample;
+    // copied without the lock, it might be evicted meanwhile
+    sample_retain(cached);
   }
 
-  if (!start_or_end_arrays_set) {
-    int acc = 0;
-    // compute start and end time
-    for (uint32_t i = 0; i < ctx->audio_samples.size(); i++) {
-      size_t sample_count;
-      op1_sample_get_length(&ctx->audio_samples[i], &sample_count);
+  try {
+    *sample = sample_copy(cached);
+  } catch (...) {
+    sample_release(cached);
+    throw;
+  }
+  (*sample)->stats.cache_hits = 1;
+  sample_release(cached);
 
-      converted_start[i] = acc;
-      acc += sample_count;
-      converted_end[i] = acc + 1;
-    }
+  LOG("decode cache hit - %zu frames\n", sample_length(*sample));
 
-    for (uint32_t i = ctx->audio_samples.size(); i < 24; i++) {
-      converted_start[i] = converted_start[ctx->audio_samples.size() - 1];
-      converted_end[i] = converted_end[ctx->audio_samples.size() - 1];
-    }
-  } else {
-    for (uint32_t i = 0; i < 24; i++) {
-      converted_start[i] = ctx->start_times[i];
-      converted_end[i] = ctx->end_times[i];
+  return true;
+}
+
+// Keep a copy of the freshly decoded `sample` for `key`.
+void cache_insert(const cache_key & key, const audio_file * sample)
+{
+  sample_cache & cache = decode_cache();
+  size_t bytes = sizeof(audio_file) + sample->data.size() * sizeof(float);
+
+  // built without the lock, and spliced in
+  op1_list<cache_entry> fresh(1);
+  cache_entry & entry = fresh.front();
+  entry.key = key;
+  entry.sample = sample_copy(sample);
+  entry.bytes = bytes;
+  op1_list<cache_entry> dropped;
+
+  try {
+    lock_guard<mutex> lock(cache.lock);
+    // unless too big, or decoded by another thread meanwhile
+    if (bytes <= cache.budget &&
+        cache_find(cache, key) == cache.entries.end()) {
+      cache.by_hash.insert(make_pair(key.digest[0], fresh.begin()));
+      cache.entries.splice(cache.entries.begin(), fresh);
+      cache.bytes += bytes;
+      cache_shrink(cache, cache.budget, &dropped);
     }
+  } catch (...) {
+    release_all(fresh);
+    throw;
   }
 
-  for (uint32_t i = 0; i < 24; i++) {
-    converted_start[i] = frame_to_op1_time(converted_start[i]);
-    converted_end[i] = frame_to_op1_time(converted_end[i]);
-  }
+  release_all(fresh);
+  release_all(dropped);
+}
 
-  // make string
-  json j;
-
-  j["drum_version"] = 1;
-  j["type"] = "drum";
-  j["name"] = "user";
-  j["octave"] = 0;
-  j["pitch"] = ctx->pitches;
-  j["start"] = converted_start;
-  j["end"] = converted_end;
-  j["playmode"] = ctx->playmode;
-  j["reverse"] = ctx->playback_direction;
-  j["volume"] = ctx->volumes;
-  j["dyna_env"] = ctx->enveloppe;
-  j["fx_active"] = ctx->fx_active;
-  j["fx_type"] = ctx->fx_type;
-  j["fx_params"] = ctx->fx_params;
-  j["lfo_active"] = ctx->lfo_active;
-  j["lfo_type"] = ctx->lfo_type;
-  j["lfo_params"] = ctx->lfo_params;
-
-  string serialized = j.dump();
-
-  LOG("json chunk: %s\n", serialized.c_str());
-
-  int rate = ctx->audio_samples[0].info.samplerate;
-  for (int i = 1; i < ctx->audio_samples.size(); i++) { 
-    if (rate != ctx->audio_samples[i].info.samplerate) {
-      return OP1_ERROR;
-    }
-  }
+int decode_memory(const uint8_t * data, size_t length,
+                  const op1_sample_options & options, audio_file ** sample)
+{
+  SF_INFO info;
+
+  SF_VIRTUAL_IO vio ;
+  vio.get_filelen = vf_get_filelen ;
+  vio.seek = vf_seek ;
+  vio.read = vf_read ;
+  vio.write = vf_write ;
+  vio.tell = vf_tell ;
 
-  SF_VIRTUAL_IO vio;
-  vio.get_filelen = vf_get_filelen;
-  vio.seek = vf_seek;
-  vio.read = vf_read;
-  vio.write = vf_write;
-  vio.tell = vf_tell;
+  PodZero(info);
 
   vio_data vdata;
   vdata.offset = 0;
+  vdata.data = data;
+  vdata.length = length;
 
-  SF_INFO info;
-  info.samplerate = rate;
-  info.channels = 1; // drums are mono
-  info.format = SF_FORMAT_AIFF | SF_FORMAT_PCM_16 | SF_ENDIAN_BIG;
-
-  SNDFILE* file = sf_open_virtual (&vio, SFM_WRITE, &info, &vdata);
+  SNDFILE* file = sf_open_virtual (&vio, SFM_READ, &info, &vdata);
   if (!file) {
     return OP1_ERROR;
   }
 
-  // set string
-  sf_set_string(file, SF_STR_SOFTWARE, serialized.c_str());
+  LOG("Buffer(%p) - rate: %d - frame count: %lld\n", data, info.samplerate,
+      static_cast<long long>(info.frames));
 
-  for (int32_t i = 0; i < ctx->audio_samples.size(); i++) {
-    int16_t * samples;
-    size_t sample_count;
-    op1_sample_get_data(&(ctx->audio_samples[i]), &samples, &sample_count);
+  return decode_and_close(file, info, options, sample);
+}
 
-    sf_count_t count = sf_writef_short(file, samples, sample_count) ;
-    if (count != sample_count) {
-      WARN("Weird write.");
-    }
-    int16_t d = 0;
-    count = sf_writef_short(file, &d, 1) ;
-    if (count != 1) {
-      WARN("Weird write.");
+// Decode `data`, or copy it from the decode cache if it is enabled and the
+// same content has already been decoded with the same options.
+int load_memory(const uint8_t * data, size_t length,
+                const op1_sample_options & options, audio_file ** sample)
+{
+  if (!decode_cache().enabled.load(memory_order_relaxed)) {
+    int rv = decode_memory(data, length, options, sample);
+    if (rv == OP1_SUCCESS) {
+      (*sample)->stats.bytes_in = length;
     }
+    return rv;
   }
 
-  int rv = sf_close(file);
-  if (rv != 0) {
-    FATAL("Could not close output file.");
-  }
+  cache_key key;
+  content_digest(data, length, key.digest);
+  key.length = length;
+  key.options = options;
 
-  vector<uint8_t>& buf = vdata.data;
+  if (cache_lookup(key, sample)) {
+    (*sample)->stats.bytes_in = length;
+    return OP1_SUCCESS;
+  }
 
-  // find AAPL capture pattern
-  size_t i = 0;
-  while (i < buf.size() - 4) {
-    if (buf[i + 0] == 'A' &&
-        buf[i + 1] == 'P' &&
-        buf[i + 2] == 'P' &&
-        buf[i + 3] == 'L') {
-      break;
+  int rv = decode_memory(data, length, options, sample);
+  if (rv == OP1_SUCCESS) {
+    (*sample)->stats.bytes_in = length;
+    (*sample)->stats.cache_misses = 1;
+    try {
+      cache_insert(key, *sample);
+    } catch (bad_alloc &) {
+      // the sample is just not cached
     }
-    i++;
   }
 
-  assert(buf[i + 0] == 'A' &&
-         buf[i + 1] == 'P' &&
-         buf[i + 2] == 'P' &&
-         buf[i + 3] == 'L');
+  return rv;
+}
 
-  i += 4;
+bool valid_options(const op1_sample_options * options)
+{
+  return options->resample_quality >= OP1_RESAMPLE_NONE &&
+         options->resample_quality <= OP1_RESAMPLE_BEST &&
+         options->downmix >= OP1_DOWNMIX_AVERAGE &&
+         options->downmix <= OP1_DOWNMIX_MAX_ENERGY &&
+         options->normalize >= OP1_NORMALIZE_NONE &&
+         options->normalize <= OP1_NORMALIZE_RMS &&
+         std::isfinite(options->normalize_target_db) &&
+         (options->trim == 0 || options->trim == 1) &&
+         (!options->trim || valid_trim_options(options->trim_options));
+}
+}
 
-  uint32_t chunk_size_index = i;
+int op1_sample_options_init(op1_sample_options * options)
+{
+  ENSURE_VALID(options);
 
-  LOG("chunk_size_index: %d\n", chunk_size_index);
+  options->resample_quality = OP1_RESAMPLE_MEDIUM;
+  options->downmix = OP1_DOWNMIX_AVERAGE;
+  options->normalize = OP1_NORMALIZE_NONE;
+  options->normalize_target_db = 0.0f;
+  options->trim = 0;
+  op1_trim_options_init(&options->trim_options);
 
-  i += 4;
+  return OP1_SUCCESS;
+}
 
-  assert(buf[i + 0] == 'm' &&
-         buf[i + 1] == '3' &&
-         buf[i + 2] == 'g' &&
-         buf[i + 3] == 'a');
+int op1_trim_options_init(op1_trim_options * options)
+{
+  ENSURE_VALID(options);
 
-  // write the APPL for the op-1, which is 'op-1'
-  buf[i + 0] = 'o';
-  buf[i + 1] = 'p';
-  buf[i + 2] = '-';
-  buf[i + 3] = '1';
+  options->threshold_db = -60.0f;
+  options->hold_ms = 20.0f;
+  options->pre_roll_ms = 2.0f;
 
-  // capture the libsnd version string, and remove it
-  while (i < buf.size() - 4) {
-    if (buf[i + 0] == ' ' &&
-        buf[i + 1] == '(' &&
-        buf[i + 2] == 'l' &&
-        buf[i + 3] == 'i') {
-      break;
-    }
-    i++;
-  }
+  return OP1_SUCCESS;
+}
 
-  uint32_t end_json = i;
+int op1_sample_cache_enable(size_t budget_bytes)
+{
+  sample_cache & cache = decode_cache();
+  op1_list<cache_entry> dropped;
 
-  uint32_t removed_char = 0;
-  while (buf[i] != ')') {
-    removed_char++;
-    i++;
+  {
+    lock_guard<mutex> lock(cache.lock);
+    cache.budget = budget_bytes;
+    cache.enabled.store(budget_bytes != 0, memory_order_relaxed);
+    cache_shrink(cache, budget_bytes, &dropped);
   }
 
-  removed_char++;
-  i++;
+  release_all(dropped);
 
-  int32_t chunk_size = (buf[chunk_size_index + 3] << 0)
-                     | (buf[chunk_size_index + 2] << 8)
-                     | (buf[chunk_size_index + 1] << 16)
-                     | (buf[chunk_size_index + 0] << 24);
-  LOG("APPL chunk_size: %d\n", chunk_size);
+  return OP1_SUCCESS;
+}
+
+int op1_sample_cache_get_stats(op1_sample_cache_stats * stats)
+{
+  ENSURE_VALID(stats);
 
-  // move back the data and update the chunk size
-  memmove(buf.data() + end_json,
-          buf.data() + end_json + removed_char,
-          buf.size() - end_json - removed_char);
+  sample_cache & cache = decode_cache();
+  lock_guard<mutex> lock(cache.lock);
 
-  chunk_size -= removed_char;
+  stats->hits = cache.hits;
+  stats->misses = cache.misses;
+  stats->evictions = cache.evictions;
+  stats->entries = cache.entries.size();
+  stats->bytes = cache.bytes;
 
-  LOG("new chunk size: %d\n", chunk_size);
+  return OP1_SUCCESS;
+}
 
-  // udpate the AAPL chunk size
-  buf[chunk_size_index + 0] = chunk_size >> 24;
-  buf[chunk_size_index + 1] = chunk_size >> 16;
-  buf[chunk_size_index + 2] = chunk_size >>  8;
-  buf[chunk_size_index + 3] = chunk_size;
+int op1_sample_cache_clear()
+{
+  sample_cache & cache = decode_cache();
+  op1_list<cache_entry> dropped;
 
-  *length = buf.size();
-  *output = new uint8_t[*length];
+  {
+    lock_guard<mutex> lock(cache.lock);
+    cache_shrink(cache, 0, &dropped);
+    cache.hits = cache.misses = cache.evictions = 0;
+  }
 
-  memcpy(*output, buf.data(), buf.size());
+  release_all(dropped);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_write(op1_drum * ctx, const char * file_name)
+int op1_sample_load(const char * file_name, audio_file ** sample)
 {
-  ENSURE_VALID(ctx);
-  ENSURE_VALID(file_name);
+  op1_sample_options options;
+  op1_sample_options_init(&options);
 
-  uint8_t * data;
-  size_t length;
+  return op1_sample_load_with_options(file_name, &options, sample);
+}
+
+int op1_sample_load_with_options(const char * file_name,
+                                 const op1_sample_options * options,
+                                 audio_file ** sample)
+{
+  SF_INFO info;
+
+  ENSURE_VALID(file_name);
+  ENSURE_VALID(options);
+  ENSURE_VALID(sample);
 
-  op1_drum_write_buffer(ctx, &data, &length);
+  if (!valid_options(options)) {
+    return OP1_ARGUMENT_ERROR;
+  }
 
-  // write the new file
-  FILE * f = fopen(file_name, "w");
-  if (!f) {
-    FATAL("Could not open final file for writing.");
+  mapped_file mapping;
+  if (mapping.open(file_name, true) == OP1_SUCCESS) {
+    LOG("%s - mapped %zu bytes\n", file_name, mapping.size());
+    return catch_allocation_failure([&]() {
+      return load_memory(mapping.data(), mapping.size(), *options, sample);
+    });
   }
-  long written = fwrite(data, length, 1, f);
-  if (written != 1) {
-    FATAL("Did not write all the data.");
+
+  // Not something we can map (a pipe, a device...), let libsndfile read it.
+  PodZero(info);
+
+  SNDFILE* file = sf_open(file_name, SFM_READ, &info);
+  if (!file) {
+    return OP1_ERROR;
   }
-  int rv = fclose(f);
 
-  delete [] data;
+  LOG("%s - rate: %d - frame count: %lld\n", file_name, info.samplerate,
+      static_cast<long long>(info.frames));
+
+  return catch_allocation_failure([&]() {
+    return decode_and_close(file, info, *options, sample);
+  });
+}
+
+int op1_sample_load_buffer(const uint8_t * data, size_t length, audio_file ** sample)
+{
+  op1_sample_options options;
+  op1_sample_options_init(&options);
+
+  return op1_sample_load_buffer_with_options(data, length, &options, sample);
+}
+
+int op1_sample_load_buffer_with_options(const uint8_t * data, size_t length,
+                                        const op1_sample_options * options,
+                                        audio_file ** sample)
+{
+  ENSURE_VALID(data);
+  ENSURE_VALID(options);
+  ENSURE_VALID(sample);
 
-  if (rv) {
-    WARN("Could not close output file.");
+  if (!valid_options(options)) {
+    return OP1_ARGUMENT_ERROR;
   }
-  return OP1_SUCCESS;
+
+  return catch_allocation_failure([&]() {
+    return load_memory(data, length, *options, sample);
+  });
 }
 
-int op1_drum_add_sample(op1_drum * ctx, audio_file * file)
+namespace {
+// Run `load(i, &outputs[i])` for each of the `count` items on at most
+// `threads` threads, and gather the results.
+template<typename F>
+int load_many(size_t count, unsigned threads, audio_file ** outputs,
+              int * results, F load)
 {
-  ENSURE_VALID(ctx);
-  ENSURE_VALID(file);
+  parallel_for(count, threads, [&](size_t i) {
+    outputs[i] = nullptr;
+    results[i] = load(i, &outputs[i]);
+  });
 
-  ctx->audio_samples.push_back(*file);
+  for (size_t i = 0; i < count; i++) {
+    if (results[i] != OP1_SUCCESS) {
+      return OP1_ERROR;
+    }
+  }
 
   return OP1_SUCCESS;
 }
+}
 
-int op1_drum_set_fx(op1_drum * ctx, const char * fx)
+int op1_sample_load_many(const char * const * file_names, size_t count,
+                         const op1_sample_options * options, unsigned threads,
+                         audio_file ** outputs, int * results)
 {
-  ENSURE_VALID(ctx);
-  ENSURE_VALID(fx);
+  ENSURE_VALID(file_names);
+  ENSURE_VALID(options);
+  ENSURE_VALID(outputs);
+  ENSURE_VALID(results);
+
+  return load_many(count, threads, outputs, results,
+                   [&](size_t i, audio_file ** sample) {
+    return op1_sample_load_with_options(file_names[i], options, sample);
+  });
+}
 
-  vector<string> valid_effects = {
-    "cwo", "delay", "grid", "nitro", "phone", "punch", "spring"
-  };
+int op1_sample_load_buffer_many(const uint8_t * const * data,
+                                const size_t * lengths, size_t count,
+                                const op1_sample_options * options,
+                                unsigned threads, audio_file ** outputs,
+                                int * results)
+{
+  ENSURE_VALID(data);
+  ENSURE_VALID(lengths);
+  ENSURE_VALID(options);
+  ENSURE_VALID(outputs);
+  ENSURE_VALID(results);
+
+  return load_many(count, threads, outputs, results,
+                   [&](size_t i, audio_file ** sample) {
+    return op1_sample_load_buffer_with_options(data[i], lengths[i], options,
+                                               sample);
+  });
+}
+
+int op1_sample_get_data(audio_file * sample, int16_t ** data, size_t * frame_count)
+{
+  ENSURE_VALID(sample);
+  ENSURE_VALID(data);
+  ENSURE_VALID(frame_count);
 
-  if (find(valid_effects.begin(), valid_effects.end(), fx) == valid_effects.end()) {
+  if (!sample_length(sample)) {
     return OP1_ERROR;
   }
 
-  ctx->fx_type = fx;
+  int rv = catch_allocation_failure([&]() {
+    sample_decode(sample);
+    if (sample->pcm16.capacity() < sample_length(sample)) {
+      sample->stats.allocations++;
+    }
+    sample->pcm16.resize(sample_length(sample));
+    return OP1_SUCCESS;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+  dsp_float_to_int16(sample_frames(sample), sample->pcm16.data(),
+                     sample_length(sample), sample->gain);
+
+  *data = sample->pcm16.data();
+  *frame_count = sample->pcm16.size();
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_fx_active(op1_drum * ctx, int active)
+int op1_sample_get_float_data(audio_file * sample, float ** data, size_t * frame_count)
 {
-  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
+  ENSURE_VALID(data);
+  ENSURE_VALID(frame_count);
 
-  ctx->fx_active = active;
+  if (!sample_length(sample)) {
+    return OP1_ERROR;
+  }
+
+  int rv = catch_allocation_failure([&]() {
+    sample_decode(sample);
+    return OP1_SUCCESS;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  if (sample->gain != 1.0f) {
+    dsp_apply_gain(sample->data.data(), sample->data.size(), sample->gain);
+    sample->gain = 1.0f;
+    sample->normalize_mode = OP1_NORMALIZE_NONE;
+  }
+
+  // the caller may change the values
+  sample->exact16 = false;
+  sample->data_exposed = true;
+  sample->levels_known = false;
+
+  *data = sample->data.data() + sample->view_start;
+  *frame_count = sample_length(sample);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_fx_params(op1_drum * ctx, int params[8])
+int op1_sample_normalize(audio_file * sample, int mode, float target_db)
 {
-  ENSURE_VALID(ctx);
-
-  ArrayCopy(ctx->fx_params, params);
+  ENSURE_VALID(sample);
 
-  return OP1_SUCCESS;
+  return catch_allocation_failure([&]() {
+    return normalize(sample, mode, target_db);
+  });
 }
 
-int op1_drum_set_lfo(op1_drum * ctx, const char * lfo)
+int op1_sample_trim(audio_file * sample, const op1_trim_options * options)
 {
-  ENSURE_VALID(ctx);
-  ENSURE_VALID(lfo);
+  ENSURE_VALID(sample);
+  ENSURE_VALID(options);
 
-  vector<string> valid_lfo = {
-    "bend", "crank", "element", "midi", "random", "tremolo", "value"
-  };
+  return catch_allocation_failure([&]() {
+    return trim(sample, *options);
+  });
+}
+
+int op1_sample_get_length(audio_file * sample, size_t * frame_count)
+{
+  ENSURE_VALID(sample);
+  ENSURE_VALID(frame_count);
 
-  if (find(valid_lfo.begin(), valid_lfo.end(), lfo) == valid_lfo.end()) {
+  if (!sample_length(sample)) {
     return OP1_ERROR;
   }
 
-  ctx->lfo_type = lfo;
+  *frame_count = sample_length(sample);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_lfo_active(op1_drum * ctx, int active)
+int op1_sample_get_rate(audio_file * sample, int * rate)
 {
-  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
+  ENSURE_VALID(rate);
 
-  ctx->lfo_active = active;
+  *rate = sample->info.samplerate;
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_lfo_params(op1_drum * ctx, int params[8])
+int op1_sample_get_stats(audio_file * sample, op1_stats * stats)
 {
-  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
+  ENSURE_VALID(stats);
 
-  ArrayCopy(ctx->lfo_params, params);
+  *stats = sample->stats;
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_playmode(op1_drum * ctx, int params[24])
+int op1_sample_retain(audio_file * sample)
 {
-  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
 
-  ArrayCopy(ctx->playmode, params);
+  sample_retain(sample);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_playback_direction(op1_drum * ctx, int params[24])
+int op1_sample_destroy(audio_file * sample)
 {
-  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
 
-  ArrayCopy(ctx->playback_direction, params);
+  sample_release(sample);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_enveloppe(op1_drum * ctx, int enveloppe[8])
+int op1_drum_init(op1_drum ** ctx)
 {
   ENSURE_VALID(ctx);
 
-  ArrayCopy(ctx->enveloppe, enveloppe);
+  *ctx = new (nothrow) op1_drum;
 
-  return OP1_SUCCESS;
+  return *ctx ? OP1_SUCCESS : OP1_ERROR;
 }
 
-int op1_drum_set_pitches(op1_drum * ctx, int pitches[24])
+int op1_drum_destroy(op1_drum * ctx)
 {
   ENSURE_VALID(ctx);
 
-  ArrayCopy(ctx->pitches, pitches);
+  delete ctx;
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_volumes(op1_drum * ctx, int volumes[24])
+int op1_drum_reset(op1_drum * ctx)
 {
   ENSURE_VALID(ctx);
 
-  ArrayCopy(ctx->volumes, volumes);
+  ctx->release_samples();
+  // clearing keeps the memory of all the vectors
+  ctx->audio_samples.clear();
+  ctx->reset_fits();
+  ctx->set_defaults();
+  ctx->audio_generation++;
+  ctx->encoded_generation = UINT64_MAX;
+  ctx->encoded_sample_generations.clear();
+  PodZero(ctx->stats);
 
   return OP1_SUCCESS;
 }
 
-int op1_drum_set_start_times(op1_drum * ctx, int start_times[24])
+namespace {
+export_slot slot_for(const op1_drum * ctx, size_t i)
 {
-  ENSURE_VALID(ctx);
-
-  ArrayCopy(ctx->start_times, start_times);
+  audio_file * sample = ctx->audio_samples[i];
+  const slot_fit & fit = ctx->fits[i];
+  export_slot slot;
+
+  slot.sample = sample;
+  slot.pcm = nullptr;
+  if (fit.compressed.empty()) {
+    if (sample->pcm && sample_is_exact16(sample) && !fit.fade_out) {
+      // unchanged since it was read, no need to decode it
+      slot.frames = nullptr;
+      slot.pcm = sample->pcm + sample->view_start * sizeof(int16_t);
+    } else {
+      sample_decode(sample);
+      slot.frames = sample_frames(sample);
+    }
+    slot.length = min(fit.length, sample_length(sample));
+  } else {
+    slot.frames = fit.compressed.data();
+    slot.length = min(fit.length, fit.compressed.size());
+  }
+  slot.fade_out = min(fit.fade_out, slot.length);
 
-  return OP1_SUCCESS;
+  return slot;
 }
 
-int op1_drum_set_end_times(op1_drum * ctx, int end_times[24])
+// Everything needed to render a drum kit, computed before writing anything.
+struct drum_export
 {
-  ENSURE_VALID(ctx);
+  explicit drum_export(op1_drum * ctx)
+    : slots(ctx->export_slots)
+  {}
+
+  char appl[DRUM_APPL_CAPACITY];
+  size_t appl_length;
+  int rate;
+  // The scratch space of the context.
+  op1_vector<export_slot> & slots;
+  size_t frame_count;
+  size_t length;
+};
 
-  ArrayCopy(ctx->end_times, end_times);
+int build_export(op1_drum * ctx, drum_export * plan)
+{
+  if (ctx->audio_samples.empty()) {
+    return OP1_ERROR;
+  }
 
-  return OP1_SUCCESS;
+  if (ctx->audio_samples.size() > 24) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  plan->rate = ctx->audio_samples[0]->info.samplerate;
+  plan->frame_count = 0;
+  plan->slots.clear();
+  if (plan->slots.capacity() < ctx->audio_samples.size()) {
+    plan->slots.reserve(ctx->audio_samples.size());
+    ctx->stats.allocations++;
+  }
+  for (uint32_t i = 0; i < ctx->audio_samples.size(); i++) {
+    if (plan->rate != ctx->audio_samples[i]->info.samplerate) {
+      return OP1_ERROR;
+    }
+    plan->slots.push_back(slot_for(ctx, i));
+    // each sample is followed by a silent frame
+    plan->frame_count += plan->slots[i].length + 1;
+  }
+
+  if (plan->frame_count > OP1_DRUM_MAX_FRAMES) {
+    LOG("%zu frames, the maximum is %d\n", plan->frame_count,
+        OP1_DRUM_MAX_FRAMES);
+    return OP1_OVER_BUDGET;
+  }
+
+  std::array<uint64_t, 24> converted_start;
+  std::array<uint64_t, 24> converted_end;
+
+  bool start_or_end_arrays_set = false;
+
+  for (uint32_t i = 0; i < 24; i++) {
+    if (ctx->start_times[i] != 0 || ctx->end_times[i] != 0) {
+      start_or_end_arrays_set = true;
+    }
+  }
+
+  if (!start_or_end_arrays_set) {
+    int acc = 0;
+    // compute start and end time, where the audio of each slot is: it is
+    // followed by a silent frame
+    for (uint32_t i = 0; i < plan->slots.size(); i++) {
+      converted_start[i] = acc;
+      acc += plan->slots[i].length;
+      converted_end[i] = acc;
+      acc++;
+    }
+
+    for (uint32_t i = ctx->audio_samples.size(); i < 24; i++) {
+      converted_start[i] = converted_start[ctx->audio_samples.size() - 1];
+      converted_end[i] = converted_end[ctx->audio_samples.size() - 1];
+    }
+  } else {
+    for (uint32_t i = 0; i < 24; i++) {
+      converted_start[i] = ctx->start_times[i];
+      converted_end[i] = ctx->end_times[i];
+    }
+  }
+
+  for (uint32_t i = 0; i < 24; i++) {
+    converted_start[i] = frame_to_op1_time(converted_start[i]);
+    converted_end[i] = frame_to_op1_time(converted_end[i]);
+    // only markers set by the caller can be out of range, the computed ones
+    // are kept in range by OP1_DRUM_MAX_FRAMES, see the static_assert
+    if (converted_start[i] > OP1_DRUMKIT_END ||
+        converted_end[i] > OP1_DRUMKIT_END) {
+      LOG("marker %u is past the end of an OP-1 drum kit\n", i);
+      return OP1_OVER_BUDGET;
+    }
+  }
+
+  drum_appl appl;
+  appl.enveloppe = ctx->enveloppe;
+  appl.end = converted_end;
+  appl.fx_active = ctx->fx_active;
+  appl.fx_params = ctx->fx_params;
+  appl.fx_type = ctx->fx_type;
+  appl.lfo_active = ctx->lfo_active;
+  appl.lfo_params = ctx->lfo_params;
+  appl.lfo_type = ctx->lfo_type;
+  appl.pitches = ctx->pitches;
+  appl.playmode = ctx->playmode;
+  appl.playback_direction = ctx->playback_direction;
+  appl.start = converted_start;
+  appl.volumes = ctx->volumes;
+
+  {
+    phase_timer timer(&ctx->stats.serialize_ns);
+    plan->appl_length = appl_write_drum(appl, plan->appl);
+  }
+
+  LOG("json chunk: %.*s\n", static_cast<int>(plan->appl_length), plan->appl);
+
+  plan->length = aiff_file_size(plan->appl_length, plan->frame_count);
+
+  return OP1_SUCCESS;
+}
+
+// Decide what an export writes. Decodes the samples read from OP-1 files that
+// have not been yet.
+int prepare_export(op1_drum * ctx, drum_export * plan)
+{
+  return catch_allocation_failure([&]() {
+    return build_export(ctx, plan);
+  });
+}
+
+// Seed of the dither generators, so that exporting the same kit twice gives
+// the same file.
+const uint32_t DITHER_SEED = 0x4f502d31;
+
+// Number of frames quantized at once.
+const size_t QUANTIZE_BLOCK_FRAMES = 1024;
+
+// The single quantization step from the float audio of the samples to the
+// big-endian 16-bit audio of the file.
+struct quantizer
+{
+  explicit quantizer(int dither)
+    : dither(dither)
+  {
+    dsp_dither_init(&state, DITHER_SEED);
+  }
+
+  // Write `count` frames of `slot`, starting at `offset`, at `out`.
+  uint8_t * write(const export_slot & slot, size_t offset, size_t count,
+                  uint8_t * out)
+  {
+    if (slot.pcm) {
+      size_t bytes = count * sizeof(int16_t);
+      memcpy(out, slot.pcm + offset * sizeof(int16_t), bytes);
+      return out + bytes;
+    }
+
+    const float * in = slot.frames + offset;
+    const float gain = slot.sample->gain;
+    const size_t fade_start = slot.length - slot.fade_out;
+    // exact values round to themselves, they don't need dither
+    const bool exact = sample_is_exact16(slot.sample) &&
+                       slot.frames == sample_frames(slot.sample) &&
+                       !slot.fade_out;
+    int16_t block[QUANTIZE_BLOCK_FRAMES];
+    float faded[QUANTIZE_BLOCK_FRAMES];
+
+    if (!offset) {
+      // don't shape the start of a sample with the end of the previous one
+      state.error = 0.0f;
+    }
+
+    while (count) {
+      size_t n = min(count, QUANTIZE_BLOCK_FRAMES);
+      const float * source = in;
+      if (offset + n > fade_start) {
+        // linear fade to silence, reaching it just after the last frame
+        for (size_t i = 0; i < n; i++) {
+          size_t position = offset + i;
+          faded[i] = in[i];
+          if (position >= fade_start) {
+            faded[i] *= static_cast<float>(slot.length - position) /
+                        (slot.fade_out + 1);
+          }
+        }
+        source = faded;
+      }
+      if (exact || dither == OP1_DITHER_NONE) {
+        dsp_float_to_int16(source, block, n, gain);
+      } else if (dither == OP1_DITHER_SHAPED) {
+        dsp_quantize_shaped(source, block, n, gain, &state);
+      } else {
+        dsp_quantize_tpdf(source, block, n, gain, &state);
+      }
+      out = aiff_write_frames(out, block, n);
+      in += n;
+      offset += n;
+      count -= n;
+    }
+
+    return out;
+  }
+
+  int dither;
+  dither_state state;
+};
+
+bool encoded_is_current(const op1_drum * ctx)
+{
+  if (ctx->encoded_generation != ctx->audio_generation ||
+      ctx->encoded_sample_generations.size() != ctx->audio_samples.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < ctx->audio_samples.size(); i++) {
+    const audio_file * sample = ctx->audio_samples[i];
+    if (sample->data_exposed ||
+        sample->generation != ctx->encoded_sample_generations[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Quantize the audio of each slot of `plan`, followed by a silent frame, into
+// the SSND payload, unless the last export already did.
+const op1_vector<uint8_t> & encode_audio(op1_drum * ctx, const drum_export & plan)
+{
+  if (encoded_is_current(ctx)) {
+    LOG("reusing %zu encoded frames\n", plan.frame_count);
+    ctx->stats.cache_hits++;
+    return ctx->encoded;
+  }
+
+  phase_timer timer(&ctx->stats.encode_ns);
+  ctx->stats.cache_misses++;
+
+  quantizer q(ctx->dither);
+  if (ctx->encoded.capacity() < plan.frame_count * sizeof(int16_t)) {
+    ctx->stats.allocations++;
+  }
+  ctx->encoded.resize(plan.frame_count * sizeof(int16_t));
+  uint8_t * out = ctx->encoded.data();
+
+  for (uint32_t i = 0; i < plan.slots.size(); i++) {
+    const int16_t silence = 0;
+
+    out = q.write(plan.slots[i], 0, plan.slots[i].length, out);
+    out = aiff_write_frames(out, &silence, 1);
+  }
+
+  assert(out == ctx->encoded.data() + ctx->encoded.size());
+
+  ctx->encoded_generation = ctx->audio_generation;
+  ctx->encoded_sample_generations.resize(ctx->audio_samples.size());
+  for (size_t i = 0; i < ctx->audio_samples.size(); i++) {
+    ctx->encoded_sample_generations[i] = ctx->audio_samples[i]->generation;
+  }
+
+  return ctx->encoded;
+}
+
+int render_export(op1_drum * ctx, const drum_export & plan, uint8_t * output)
+{
+  return catch_allocation_failure([&]() {
+    const op1_vector<uint8_t> & audio = encode_audio(ctx, plan);
+
+    phase_timer timer(&ctx->stats.patch_ns);
+    uint8_t * out = aiff_write_header(output, plan.rate, plan.frame_count,
+                                      plan.appl, plan.appl_length);
+    memcpy(out, audio.data(), audio.size());
+    ctx->stats.bytes_out += plan.length;
+
+    assert(out + audio.size() == output + plan.length);
+
+    return OP1_SUCCESS;
+  });
+}
+
+// Number of frames handed to the callback at once when streaming the SSND
+// payload.
+const size_t STREAM_CHUNK_FRAMES = 4096;
+
+// Quantizes the audio of the slots into a fixed chunk, handed to the callback
+// each time it is full, so that streaming uses the same memory for any kit.
+struct stream_writer
+{
+  stream_writer(op1_write_callback callback, void * user_data, int dither)
+    : callback(callback)
+    , user_data(user_data)
+    , q(dither)
+    , used(0)
+  {}
+
+  int write(const uint8_t * data, size_t length)
+  {
+    if (callback(data, length, user_data)) {
+      return OP1_IO_ERROR;
+    }
+    return OP1_SUCCESS;
+  }
+
+  int append(const export_slot & slot)
+  {
+    size_t offset = 0;
+    size_t count = slot.length;
+    while (count) {
+      size_t n = min(count, STREAM_CHUNK_FRAMES - used);
+      q.write(slot, offset, n, chunk + used * sizeof(int16_t));
+      used += n;
+      offset += n;
+      count -= n;
+      int rv = flush_if_full();
+      if (rv != OP1_SUCCESS) {
+        return rv;
+      }
+    }
+    return OP1_SUCCESS;
+  }
+
+  int append_silence()
+  {
+    const int16_t silence = 0;
+    aiff_write_frames(chunk + used * sizeof(int16_t), &silence, 1);
+    used++;
+    return flush_if_full();
+  }
+
+  int flush_if_full()
+  {
+    if (used == STREAM_CHUNK_FRAMES) {
+      return flush();
+    }
+    return OP1_SUCCESS;
+  }
+
+  int flush()
+  {
+    if (!used) {
+      return OP1_SUCCESS;
+    }
+    int rv = write(chunk, used * sizeof(int16_t));
+    used = 0;
+    return rv;
+  }
+
+  op1_write_callback callback;
+  void * user_data;
+  quantizer q;
+  size_t used;
+  uint8_t chunk[STREAM_CHUNK_FRAMES * sizeof(int16_t)];
+};
+
+// Hand the SSND payload kept by the context to `callback`, in chunks.
+int stream_encoded(const op1_vector<uint8_t> & audio,
+                   op1_write_callback callback, void * user_data)
+{
+  const size_t CHUNK_BYTES = STREAM_CHUNK_FRAMES * sizeof(int16_t);
+  for (size_t offset = 0; offset < audio.size(); offset += CHUNK_BYTES) {
+    size_t length = min(CHUNK_BYTES, audio.size() - offset);
+    if (callback(audio.data() + offset, length, user_data)) {
+      return OP1_IO_ERROR;
+    }
+  }
+  return OP1_SUCCESS;
+}
+
+// Quantize the audio of each slot of `plan`, followed by a silent frame,
+// straight to `callback`.
+int stream_audio(op1_drum * ctx, const drum_export & plan,
+                 op1_write_callback callback, void * user_data)
+{
+  stream_writer writer(callback, user_data, ctx->dither);
+
+  for (uint32_t i = 0; i < plan.slots.size(); i++) {
+    int rv = writer.append(plan.slots[i]);
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+    rv = writer.append_silence();
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+  }
+
+  return writer.flush();
+}
+
+int stream_export(op1_drum * ctx, const drum_export & plan,
+                  op1_write_callback callback, void * user_data)
+{
+  op1_vector<uint8_t> & header = ctx->header;
+  int rv = catch_allocation_failure([&]() {
+    size_t size = aiff_header_size(plan.appl_length);
+    if (header.capacity() < size) {
+      ctx->stats.allocations++;
+    }
+    header.resize(size);
+    return OP1_SUCCESS;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  bool cached = encoded_is_current(ctx);
+  // includes the time spent in `callback`
+  phase_timer timer(cached ? &ctx->stats.patch_ns : &ctx->stats.encode_ns);
+  aiff_write_header(header.data(), plan.rate, plan.frame_count,
+                    plan.appl, plan.appl_length);
+
+  if (callback(header.data(), header.size(), user_data)) {
+    return OP1_IO_ERROR;
+  }
+
+  if (cached) {
+    LOG("reusing %zu encoded frames\n", plan.frame_count);
+    ctx->stats.cache_hits++;
+    rv = stream_encoded(ctx->encoded, callback, user_data);
+  } else {
+    ctx->stats.cache_misses++;
+    rv = stream_audio(ctx, plan, callback, user_data);
+  }
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  ctx->stats.bytes_out += plan.length;
+
+  return OP1_SUCCESS;
+}
+
+int write_to_file(const uint8_t * data, size_t length, void * user_data)
+{
+  FILE * f = reinterpret_cast<FILE*>(user_data);
+  return fwrite(data, length, 1, f) != 1;
+}
+
+int write_to_fd(const uint8_t * data, size_t length, void * user_data)
+{
+  int fd = *reinterpret_cast<int*>(user_data);
+  while (length) {
+    ssize_t written = ::write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+}
+
+int op1_drum_get_output_size(op1_drum * ctx, size_t * length)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(length);
+
+  drum_export plan(ctx);
+  int rv = prepare_export(ctx, &plan);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  *length = plan.length;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_write_into(op1_drum * ctx, uint8_t * output, size_t capacity)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(output);
+
+  drum_export plan(ctx);
+  int rv = prepare_export(ctx, &plan);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  if (capacity < plan.length) {
+    return OP1_BUFFER_TOO_SMALL;
+  }
+
+  return render_export(ctx, plan, output);
+}
+
+int op1_drum_write_buffer(op1_drum * ctx, uint8_t ** output, size_t * length)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(output);
+  ENSURE_VALID(length);
+
+  drum_export plan(ctx);
+  int rv = prepare_export(ctx, &plan);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  uint8_t * buffer = static_cast<uint8_t*>(op1_allocate(plan.length));
+  if (!buffer) {
+    LOG_ERROR("Out of memory.");
+    return OP1_ERROR;
+  }
+  ctx->stats.allocations++;
+
+  rv = render_export(ctx, plan, buffer);
+  if (rv != OP1_SUCCESS) {
+    op1_deallocate(buffer);
+    return rv;
+  }
+
+  *output = buffer;
+  *length = plan.length;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_free_buffer(uint8_t * buffer)
+{
+  ENSURE_VALID(buffer);
+
+  op1_deallocate(buffer);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_write_stream(op1_drum * ctx, op1_write_callback callback, void * user_data)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(callback);
+
+  drum_export plan(ctx);
+  int rv = prepare_export(ctx, &plan);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  return stream_export(ctx, plan, callback, user_data);
+}
+
+int op1_drum_write_fd(op1_drum * ctx, int fd)
+{
+  ENSURE_VALID(ctx);
+
+  if (fd < 0) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  return op1_drum_write_stream(ctx, write_to_fd, &fd);
+}
+
+int op1_drum_write(op1_drum * ctx, const char * file_name)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(file_name);
+
+  drum_export plan(ctx);
+  int rv = prepare_export(ctx, &plan);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  FILE * f = fopen(file_name, "wb");
+  if (!f) {
+    LOG("Could not open %s for writing.\n", file_name);
+    return OP1_IO_ERROR;
+  }
+
+  rv = stream_export(ctx, plan, write_to_file, f);
+
+  if (fclose(f) && rv == OP1_SUCCESS) {
+    rv = OP1_IO_ERROR;
+  }
+
+  if (rv != OP1_SUCCESS) {
+    LOG("Could not write %s.\n", file_name);
+    remove(file_name);
+  }
+
+  return rv;
+}
+
+int op1_drum_add_sample(op1_drum * ctx, audio_file * file)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(file);
+
+  if (ctx->audio_samples.size() == 24) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  // the fit is pushed first: a spare one is harmless if the sample can't be
+  int rv = catch_allocation_failure([&]() {
+    // the slot of a sample released by `op1_drum_reset` is reused
+    if (ctx->fits.size() == ctx->audio_samples.size()) {
+      ctx->fits.push_back(slot_fit());
+    }
+    ctx->audio_samples.push_back(file);
+    return OP1_SUCCESS;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  sample_retain(file);
+  ctx->audio_generation++;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_fx(op1_drum * ctx, const char * fx)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(fx);
+
+  const char * type = find_type(FX_TYPES, fx);
+  if (!type) {
+    return OP1_ERROR;
+  }
+
+  ctx->fx_type = type;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_fx_active(op1_drum * ctx, int active)
+{
+  ENSURE_VALID(ctx);
+
+  ctx->fx_active = active;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_fx_params(op1_drum * ctx, int params[8])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->fx_params, params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_lfo(op1_drum * ctx, const char * lfo)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(lfo);
+
+  const char * type = find_type(LFO_TYPES, lfo);
+  if (!type) {
+    return OP1_ERROR;
+  }
+
+  ctx->lfo_type = type;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_lfo_active(op1_drum * ctx, int active)
+{
+  ENSURE_VALID(ctx);
+
+  ctx->lfo_active = active;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_lfo_params(op1_drum * ctx, int params[8])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->lfo_params, params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_playmode(op1_drum * ctx, int params[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->playmode, params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_playback_direction(op1_drum * ctx, int params[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->playback_direction, params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_enveloppe(op1_drum * ctx, int enveloppe[8])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->enveloppe, enveloppe);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_pitches(op1_drum * ctx, int pitches[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->pitches, pitches);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_volumes(op1_drum * ctx, int volumes[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->volumes, volumes);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_start_times(op1_drum * ctx, int start_times[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->start_times, start_times);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_dither(op1_drum * ctx, int dither)
+{
+  ENSURE_VALID(ctx);
+
+  if (dither < OP1_DITHER_NONE || dither > OP1_DITHER_SHAPED) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  if (ctx->dither != dither) {
+    ctx->dither = dither;
+    ctx->audio_generation++;
+  }
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_set_end_times(op1_drum * ctx, int end_times[24])
+{
+  ENSURE_VALID(ctx);
+
+  ArrayCopy(ctx->end_times, end_times);
+
+  return OP1_SUCCESS;
+}
+
+namespace {
+template<size_t S>
+void ArrayCopyOut(int * lhs, const std::array<int, S> & rhs)
+{
+  for (size_t i = 0; i < S; i++) {
+    lhs[i] = rhs[i];
+  }
+}
+}
+
+int op1_drum_get_sample_count(op1_drum * ctx, size_t * count)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(count);
+
+  *count = ctx->audio_samples.size();
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_sample(op1_drum * ctx, size_t index, audio_file ** sample)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(sample);
+
+  if (index >= ctx->audio_samples.size()) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  *sample = ctx->audio_samples[index];
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_fx(op1_drum * ctx, const char ** fx)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(fx);
+
+  *fx = ctx->fx_type;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_fx_active(op1_drum * ctx, int * active)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(active);
+
+  *active = ctx->fx_active;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_fx_params(op1_drum * ctx, int params[8])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(params);
+
+  ArrayCopyOut(params, ctx->fx_params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_lfo(op1_drum * ctx, const char ** lfo)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(lfo);
+
+  *lfo = ctx->lfo_type;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_lfo_active(op1_drum * ctx, int * active)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(active);
+
+  *active = ctx->lfo_active;
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_lfo_params(op1_drum * ctx, int params[8])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(params);
+
+  ArrayCopyOut(params, ctx->lfo_params);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_playmode(op1_drum * ctx, int params[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(params);
+
+  ArrayCopyOut(params, ctx->playmode);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_playback_direction(op1_drum * ctx, int params[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(params);
+
+  ArrayCopyOut(params, ctx->playback_direction);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_enveloppe(op1_drum * ctx, int enveloppe[8])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(enveloppe);
+
+  ArrayCopyOut(enveloppe, ctx->enveloppe);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_pitches(op1_drum * ctx, int pitches[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(pitches);
+
+  ArrayCopyOut(pitches, ctx->pitches);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_volumes(op1_drum * ctx, int volumes[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(volumes);
+
+  ArrayCopyOut(volumes, ctx->volumes);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_start_times(op1_drum * ctx, int start_times[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(start_times);
+
+  ArrayCopyOut(start_times, ctx->start_times);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_end_times(op1_drum * ctx, int end_times[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(end_times);
+
+  ArrayCopyOut(end_times, ctx->end_times);
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_get_stats(op1_drum * ctx, op1_stats * stats)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(stats);
+
+  *stats = ctx->stats;
+
+  return OP1_SUCCESS;
+}
+
+namespace {
+// Length of the fade out of truncated slots.
+const size_t FIT_FADE_FRAMES = OP1_SAMPLE_RATE / 100;
+
+// Slots are sped up at most this much when compressing.
+const float FIT_MAX_SPEED = 2.0f;
+
+// Shorten every slot by the same proportion, so that they add up to at most
+// `available` frames.
+void fit_truncate(op1_vector<slot_fit> & fits, op1_vector<size_t> & lengths,
+                  size_t available)
+{
+  size_t total = 0;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    total += lengths[i];
+  }
+  if (total <= available) {
+    return;
+  }
+
+  double scale = static_cast<double>(available) / total;
+  for (size_t i = 0; i < lengths.size(); i++) {
+    size_t length = max<size_t>(1, lengths[i] * scale);
+    if (length < lengths[i]) {
+      fits[i].fade_out = min(FIT_FADE_FRAMES, length / 2);
+    }
+    fits[i].length = lengths[i] = length;
+  }
+}
+
+// Drop what is below -60dB at the end of each slot, keeping a short tail.
+void fit_trim_silence(op1_drum * ctx, op1_vector<size_t> & lengths)
+{
+  op1_trim_options options;
+  op1_trim_options_init(&options);
+  float threshold = pow(10.0, options.threshold_db / 20.0);
+
+  for (size_t i = 0; i < lengths.size(); i++) {
+    audio_file * sample = ctx->audio_samples[i];
+    sample_decode(sample);
+    // the threshold is relative to the exported level
+    float level = threshold / sample->gain;
+    size_t last = dsp_find_last_above(sample_frames(sample), lengths[i], level);
+    if (last == lengths[i]) {
+      last = 0;
+    }
+    size_t hold = milliseconds_to_frames(options.hold_ms,
+                                         sample->info.samplerate);
+    ctx->fits[i].length = lengths[i] = min(lengths[i], last + 1 + hold);
+  }
+}
+
+// Speed up the longest slots, so that no slot is longer than a common length,
+// chosen for all of them to fit in `available` frames.
+int fit_compress(op1_drum * ctx, op1_vector<size_t> & lengths, size_t available)
+{
+  op1_vector<size_t> sorted(lengths);
+  sort(sorted.begin(), sorted.end());
+
+  size_t remaining = available;
+  size_t cap = SIZE_MAX;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    size_t slots_left = sorted.size() - i;
+    if (sorted[i] * slots_left > remaining) {
+      cap = remaining / slots_left;
+      break;
+    }
+    remaining -= sorted[i];
+  }
+
+  for (size_t i = 0; i < lengths.size(); i++) {
+    if (lengths[i] <= cap) {
+      continue;
+    }
+    audio_file * sample = ctx->audio_samples[i];
+    sample_decode(sample);
+    size_t target = max<size_t>(cap, lengths[i] / FIT_MAX_SPEED);
+    slot_fit & fit = ctx->fits[i];
+    // playing `lengths[i]` frames in `target` frames
+    phase_timer timer(&ctx->stats.convert_ns);
+    int rv = resample(sample_frames(sample), lengths[i], lengths[i], target,
+                      OP1_RESAMPLE_FAST, fit.compressed);
+    ctx->stats.allocations++;
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+    fit.speed = static_cast<float>(lengths[i]) / target;
+    fit.length = lengths[i] = min(target, fit.compressed.size());
+  }
+
+  return OP1_SUCCESS;
+}
+
+int fit_drum(op1_drum * ctx, int policy, op1_fit_report * report)
+{
+  size_t count = ctx->audio_samples.size();
+
+  ctx->reset_fits();
+  ctx->audio_generation++;
+
+  op1_vector<size_t> before(count);
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    before[i] = sample_length(ctx->audio_samples[i]);
+    total += before[i];
+  }
+
+  // each slot is followed by a silent frame
+  size_t available = OP1_DRUM_MAX_FRAMES - count;
+  op1_vector<size_t> lengths(before);
+
+  if (total > available) {
+    int rv = OP1_SUCCESS;
+    if (policy == OP1_FIT_TRIM_SILENCE) {
+      fit_trim_silence(ctx, lengths);
+    } else if (policy == OP1_FIT_COMPRESS) {
+      rv = fit_compress(ctx, lengths, available);
+    }
+    if (rv != OP1_SUCCESS) {
+      ctx->reset_fits();
+      return rv;
+    }
+    fit_truncate(ctx->fits, lengths, available);
+  }
+
+  if (report) {
+    report->frames_before = total + count;
+    report->frames_after = count;
+    report->slot_count = count;
+    for (size_t i = 0; i < count; i++) {
+      op1_fit_slot & slot = report->slots[i];
+      slot.frames_before = before[i];
+      slot.frames_after = lengths[i];
+      slot.fade_frames = ctx->fits[i].fade_out;
+      slot.speed = ctx->fits[i].speed;
+      report->frames_after += lengths[i];
+    }
+  }
+
+  LOG("fitted %zu frames in %zu\n", total + count, available + count);
+
+  return OP1_SUCCESS;
+}
+}
+
+int op1_drum_fit(op1_drum * ctx, int policy, op1_fit_report * report)
+{
+  ENSURE_VALID(ctx);
+
+  if (policy < OP1_FIT_TRUNCATE || policy > OP1_FIT_COMPRESS) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  if (ctx->audio_samples.size() > 24) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  int rv = catch_allocation_failure([&]() {
+    return fit_drum(ctx, policy, report);
+  });
+  if (rv != OP1_SUCCESS) {
+    ctx->reset_fits();
+  }
+
+  return rv;
+}
+
+namespace {
+// Read the array `key` of `j` into `out`, if it is there.
+template<size_t N>
+void read_array(const json & j, const char * key, array<int, N> & out)
+{
+  if (!j.count(key)) {
+    return;
+  }
+  vector<int> values = j[key].get<vector<int>>();
+  if (values.size() != N) {
+    throw std::invalid_argument(key);
+  }
+  copy(values.begin(), values.end(), out.begin());
+}
+
+// Read the start or end markers `key` of `j` into `out`, as frames.
+void read_times(const json & j, const char * key, array<int, 24> & out)
+{
+  if (!j.count(key)) {
+    return;
+  }
+  array<int, 24> times;
+  vector<int64_t> values = j[key].get<vector<int64_t>>();
+  if (values.size() != times.size()) {
+    throw std::invalid_argument(key);
+  }
+  for (size_t i = 0; i < values.size(); i++) {
+    // the same range `build_export` writes, in which frames fit in an int
+    if (values[i] < 0 || uint64_t(values[i]) > OP1_DRUMKIT_END) {
+      throw std::invalid_argument(key);
+    }
+    times[i] = op1_time_to_frame(values[i]);
+  }
+  out = times;
+}
+
+// Read the flag `key` of `j` into `out`, if it is there. The OP-1 writes
+// booleans, this library integers.
+void read_flag(const json & j, const char * key, int * out)
+{
+  if (!j.count(key)) {
+    return;
+  }
+  if (j[key].is_boolean()) {
+    *out = j[key].get<bool>();
+  } else {
+    *out = j[key].get<int>() != 0;
+  }
+}
+
+// Fill `ctx` from the JSON document of a drum kit.
+int read_drum_json(const char * appl, size_t length, op1_drum * ctx)
+{
+  try {
+    json j = json::parse(string(appl, length));
+
+    if (j.value("type", string()) != "drum") {
+      LOG("not a drum kit: %s\n", j.value("type", string()).c_str());
+      return OP1_ERROR;
+    }
+
+    read_array(j, "pitch", ctx->pitches);
+    read_array(j, "playmode", ctx->playmode);
+    read_array(j, "reverse", ctx->playback_direction);
+    read_array(j, "volume", ctx->volumes);
+    read_array(j, "dyna_env", ctx->enveloppe);
+    read_array(j, "fx_params", ctx->fx_params);
+    read_array(j, "lfo_params", ctx->lfo_params);
+    read_times(j, "start", ctx->start_times);
+    read_times(j, "end", ctx->end_times);
+
+    read_flag(j, "fx_active", &ctx->fx_active);
+    read_flag(j, "lfo_active", &ctx->lfo_active);
+    if (j.count("fx_type") &&
+        !(ctx->fx_type = find_type(FX_TYPES, j["fx_type"].get<string>().c_str()))) {
+      return OP1_ERROR;
+    }
+    if (j.count("lfo_type") &&
+        !(ctx->lfo_type = find_type(LFO_TYPES, j["lfo_type"].get<string>().c_str()))) {
+      return OP1_ERROR;
+    }
+  } catch (exception & e) {
+    LOG("invalid drum kit: %s\n", e.what());
+    return OP1_ERROR;
+  }
+
+  return OP1_SUCCESS;
+}
+
+// Read the drum kit in `data`, without decoding its audio. If `source` holds
+// nothing, the audio is copied out of `data`.
+int load_drum(const uint8_t * data, size_t length,
+              unique_ptr<pcm_source> source, op1_drum ** ctx)
+{
+  auto start = chrono::steady_clock::now();
+  aiff_contents contents;
+  int rv = aiff_read(data, length, &contents);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  // OP-1 kits are always mono 16-bit
+  if (!contents.appl || contents.channels != 1 || contents.bits != 16) {
+    return OP1_ERROR;
+  }
+
+  size_t frame_count = min<size_t>(contents.frame_count,
+                                   contents.pcm_length / sizeof(int16_t));
+
+  unique_ptr<op1_drum> drum(new op1_drum);
+  rv = read_drum_json(contents.appl, contents.appl_length, drum.get());
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  if (frame_count) {
+    unique_ptr<audio_file> sample(new audio_file);
+    const uint8_t * pcm = contents.pcm;
+
+    if (!source->mapping.data()) {
+      source->copy.assign(pcm, pcm + frame_count * sizeof(int16_t));
+      pcm = source->copy.data();
+      drum->stats.allocations++;
+    }
+
+    sample->info.samplerate = lrint(contents.rate);
+    sample->info.channels = 1;
+    sample->info.frames = frame_count;
+    sample->exact16 = true;
+    sample->pcm = pcm;
+    sample->source = move(source);
+    sample->view_start = 0;
+    sample->view_length = frame_count;
+    // the silent frame written after the last sample is written again on
+    // export
+    if (frame_count > 1 && !pcm[2 * frame_count - 2] &&
+        !pcm[2 * frame_count - 1]) {
+      sample->view_length--;
+    }
+
+    drum->fits.push_back(slot_fit());
+    drum->audio_samples.push_back(sample.get());
+    sample.release();
+  }
+
+  LOG("loaded a drum kit: %zu frames at %.0fHz\n", frame_count,
+      contents.rate);
+
+  auto elapsed = chrono::steady_clock::now() - start;
+  drum->stats.decode_ns =
+    chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+  drum->stats.bytes_in = length;
+  *ctx = drum.release();
+
+  return OP1_SUCCESS;
+}
+}
+
+int op1_drum_load(const char * file_name, op1_drum ** ctx)
+{
+  ENSURE_VALID(file_name);
+  ENSURE_VALID(ctx);
+
+  return catch_allocation_failure([&]() {
+    unique_ptr<pcm_source> source(new pcm_source);
+    // only the headers are read now, the audio maybe later
+    int rv = source->mapping.open(file_name, false);
+    if (rv != OP1_SUCCESS) {
+      return rv;
+    }
+
+    const uint8_t * data = source->mapping.data();
+    size_t length = source->mapping.size();
+
+    return load_drum(data, length, move(source), ctx);
+  });
+}
+
+int op1_drum_load_buffer(const uint8_t * data, size_t length, op1_drum ** ctx)
+{
+  ENSURE_VALID(data);
+  ENSURE_VALID(ctx);
+
+  return catch_allocation_failure([&]() {
+    unique_ptr<pcm_source> source(new pcm_source);
+    return load_drum(data, length, move(source), ctx);
+  });
+}
+
+int op1_drum_get_slices(op1_drum * ctx, op1_slice slices[24])
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(slices);
+
+  if (ctx->audio_samples.size() != 1 || !ctx->audio_samples[0]->pcm) {
+    return OP1_ERROR;
+  }
+
+  const audio_file * sample = ctx->audio_samples[0];
+  size_t frame_count = sample->info.frames;
+
+  for (size_t i = 0; i < 24; i++) {
+    size_t start = max(ctx->start_times[i], 0);
+    size_t end = max(ctx->end_times[i], 0);
+    if (end < start) {
+      swap(start, end);
+    }
+    start = min(start, frame_count);
+    end = min(end, frame_count);
+
+    slices[i].data = sample->pcm + start * sizeof(int16_t);
+    slices[i].frame_count = end - start;
+    slices[i].start = start;
+  }
+
+  return OP1_SUCCESS;
+}
+
+int op1_drum_write_slice(op1_drum * ctx, int index, const char * file_name)
+{
+  ENSURE_VALID(ctx);
+  ENSURE_VALID(file_name);
+
+  if (index < 0 || index >= 24) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  op1_slice slices[24];
+  int rv = op1_drum_get_slices(ctx, slices);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  const op1_slice & slice = slices[index];
+  op1_vector<uint8_t> header;
+  rv = catch_allocation_failure([&]() {
+    header.resize(aiff_plain_header_size());
+    return OP1_SUCCESS;
+  });
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+  aiff_write_plain_header(header.data(),
+                          ctx->audio_samples[0]->info.samplerate,
+                          slice.frame_count);
+
+  FILE * f = fopen(file_name, "wb");
+  if (!f) {
+    LOG("Could not open %s for writing.\n", file_name);
+    return OP1_IO_ERROR;
+  }
+
+  size_t bytes = slice.frame_count * sizeof(int16_t);
+  rv = write_to_file(header.data(), header.size(), f);
+  if (!rv && bytes) {
+    // straight from the mapped file
+    rv = write_to_file(slice.data, bytes, f);
+  }
+  rv = rv ? OP1_IO_ERROR : OP1_SUCCESS;
+
+  if (fclose(f) && rv == OP1_SUCCESS) {
+    rv = OP1_IO_ERROR;
+  }
+
+  if (rv != OP1_SUCCESS) {
+    LOG("Could not write %s.\n", file_name);
+    remove(file_name);
+  }
+
+  return rv;
 }
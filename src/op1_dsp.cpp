@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "op1_dsp.h"
+
+using namespace std;
+
+namespace {
+const float INT16_SCALE = 32768.0f;
+
+int16_t clip_lsb(float value)
+{
+  long rounded = lrintf(value);
+  if (rounded > INT16_MAX) {
+    return INT16_MAX;
+  }
+  if (rounded < INT16_MIN) {
+    return INT16_MIN;
+  }
+  return rounded;
+}
+}
+
+float dsp_dot(const float * a, const float * b, size_t count)
+{
+  size_t i = 0;
+  float sum = 0.0f;
+
+#if defined(__AVX2__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= count; i += 8) {
+#if defined(__FMA__)
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+#else
+    acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                           _mm256_loadu_ps(b + i)));
+#endif
+  }
+  __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc),
+                           _mm256_extractf128_ps(acc, 1));
+#elif defined(__SSE2__)
+  __m128 acc4 = _mm_setzero_ps();
+  for (; i + 4 <= count; i += 4) {
+    acc4 = _mm_add_ps(acc4, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+  acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+  acc4 = _mm_add_ss(acc4, _mm_shuffle_ps(acc4, acc4, 1));
+  sum = _mm_cvtss_f32(acc4);
+#endif
+
+  for (; i < count; i++) {
+    sum += a[i] * b[i];
+  }
+
+  return sum;
+}
+
+void dsp_int16_to_float(const int16_t * in, float * out, size_t count)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / INT16_SCALE);
+  for (; i + 8 <= count; i += 8) {
+    __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    // sign-extend to 32-bit by unpacking in the high half and shifting back
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+
+  for (; i < count; i++) {
+    out[i] = in[i] / INT16_SCALE;
+  }
+}
+
+void dsp_float_to_int16(const float * in, int16_t * out, size_t count,
+                        float gain)
+{
+  size_t i = 0;
+  const float factor = gain * INT16_SCALE;
+
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(factor);
+  // keep the conversion to 32-bit in range, packing saturates the rest
+  const __m128 lower = _mm_set1_ps(2.0f * INT16_MIN);
+  const __m128 upper = _mm_set1_ps(2.0f * INT16_MAX);
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+    a = _mm_min_ps(_mm_max_ps(a, lower), upper);
+    b = _mm_min_ps(_mm_max_ps(b, lower), upper);
+    // rounds to nearest
+    __m128i lo = _mm_cvtps_epi32(a);
+    __m128i hi = _mm_cvtps_epi32(b);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++) {
+    out[i] = clip_lsb(in[i] * factor);
+  }
+}
+
+void dsp_levels(const float * in, size_t count, float * peak, double * energy)
+{
+  size_t i = 0;
+  float max_abs = *peak;
+  double sum = 0.0;
+
+#if defined(__SSE2__)
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 max4 = _mm_set1_ps(max_abs);
+  // float lanes are flushed to the double sum regularly, to keep precision
+  const size_t FLUSH = 4096;
+  while (i + 4 <= count) {
+    __m128 acc = _mm_setzero_ps();
+    size_t end = min(count & ~size_t(3), i + FLUSH);
+    for (; i < end; i += 4) {
+      __m128 x = _mm_loadu_ps(in + i);
+      max4 = _mm_max_ps(max4, _mm_and_ps(x, abs_mask));
+      acc = _mm_add_ps(acc, _mm_mul_ps(x, x));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    sum += static_cast<double>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  }
+  float maxes[4];
+  _mm_storeu_ps(maxes, max4);
+  max_abs = max(max(maxes[0], maxes[1]), max(maxes[2], maxes[3]));
+#endif
+
+  for (; i < count; i++) {
+    max_abs = max(max_abs, fabsf(in[i]));
+    sum += static_cast<double>(in[i]) * in[i];
+  }
+
+  *peak = max_abs;
+  *energy += sum;
+}
+
+void dsp_apply_gain(float * data, size_t count, float gain)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256 gain8 = _mm256_set1_ps(gain);
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(data + i, _mm256_mul_ps(_mm256_loadu_ps(data + i), gain8));
+  }
+#elif defined(__SSE2__)
+  const __m128 gain4 = _mm_set1_ps(gain);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(data + i, _mm_mul_ps(_mm_loadu_ps(data + i), gain4));
+  }
+#endif
+
+  for (; i < count; i++) {
+    data[i] *= gain;
+  }
+}
+
+#if defined(__SSE2__)
+namespace {
+// Whether any of the 16 floats at `in` has an absolute value above
+// `threshold`.
+bool any_above16(const float * in, __m128 threshold)
+{
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 a = _mm_max_ps(_mm_and_ps(_mm_loadu_ps(in), abs_mask),
+                        _mm_and_ps(_mm_loadu_ps(in + 4), abs_mask));
+  __m128 b = _mm_max_ps(_mm_and_ps(_mm_loadu_ps(in + 8), abs_mask),
+                        _mm_and_ps(_mm_loadu_ps(in + 12), abs_mask));
+  return _mm_movemask_ps(_mm_cmpgt_ps(_mm_max_ps(a, b), threshold));
+}
+}
+#endif
+
+size_t dsp_find_first_above(const float * in, size_t count, float threshold)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // skip the silent blocks, and find the exact frame below
+  const __m128 threshold4 = _mm_set1_ps(threshold);
+  while (i + 16 <= count && !any_above16(in + i, threshold4)) {
+    i += 16;
+  }
+#endif
+
+  for (; i < count; i++) {
+    if (fabsf(in[i]) > threshold) {
+      return i;
+    }
+  }
+
+  return count;
+}
+
+size_t dsp_find_last_above(const float * in, size_t count, float threshold)
+{
+  size_t end = count;
+
+#if defined(__SSE2__)
+  const __m128 threshold4 = _mm_set1_ps(threshold);
+  while (end >= 16 && !any_above16(in + end - 16, threshold4)) {
+    end -= 16;
+  }
+#endif
+
+  while (end) {
+    end--;
+    if (fabsf(in[end]) > threshold) {
+      return end;
+    }
+  }
+
+  return count;
+}
+
+void dsp_downmix_average(const float * in, int channels, float * out,
+                         size_t frame_count)
+{
+  size_t i = 0;
+
+  if (channels == 1) {
+    memcpy(out, in, frame_count * sizeof(float));
+    return;
+  }
+
+  if (channels == 2) {
+#if defined(__SSE2__)
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= frame_count; i += 4) {
+      __m128 a = _mm_loadu_ps(in + 2 * i);
+      __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+      __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_add_ps(left, right), half));
+    }
+#endif
+    for (; i < frame_count; i++) {
+      out[i] = (in[2 * i] + in[2 * i + 1]) * 0.5f;
+    }
+    return;
+  }
+
+  const float scale = 1.0f / channels;
+  for (; i < frame_count; i++) {
+    float sum = 0.0f;
+    for (int c = 0; c < channels; c++) {
+      sum += in[i * channels + c];
+    }
+    out[i] = sum * scale;
+  }
+}
+
+void dsp_downmix_mid(const float * in, int channels, float * out,
+                     size_t frame_count)
+{
+  if (channels <= 2) {
+    dsp_downmix_average(in, channels, out, frame_count);
+    return;
+  }
+
+  for (size_t i = 0; i < frame_count; i++) {
+    out[i] = (in[i * channels] + in[i * channels + 1]) * 0.5f;
+  }
+}
+
+void dsp_extract_channel(const float * in, int channels, int channel,
+                         float * out, size_t frame_count)
+{
+  in += channel;
+  for (size_t i = 0; i < frame_count; i++) {
+    out[i] = in[i * channels];
+  }
+}
+
+void dsp_channel_energies(const float * in, int channels, size_t frame_count,
+                          double * energies)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  if (channels == 2) {
+    // lanes 0 and 2 accumulate the left channel, 1 and 3 the right channel
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 2 <= frame_count; i += 2) {
+      __m128 frames = _mm_loadu_ps(in + 2 * i);
+      acc = _mm_add_ps(acc, _mm_mul_ps(frames, frames));
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, acc);
+    energies[0] += sums[0] + sums[2];
+    energies[1] += sums[1] + sums[3];
+  }
+#endif
+
+  for (; i < frame_count; i++) {
+    for (int c = 0; c < channels; c++) {
+      double sample = in[i * channels + c];
+      energies[c] += sample * sample;
+    }
+  }
+}
+
+namespace {
+// Step of the Weyl sequence the dither is generated from.
+const uint32_t DITHER_STEP = 0x9E3779B9;
+
+// The dither of a frame only depends on its position, so the output does not
+// depend on how the audio is split in blocks: frame n draws from
+// `hash(counter + n * DITHER_STEP)`.
+uint32_t hash(uint32_t x)
+{
+  for (int round = 0; round < 2; round++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+  }
+  return x;
+}
+
+// Difference of two uniform variables in [0, 1), from the two halves of a
+// draw: triangular in (-1, 1).
+float tpdf(uint32_t draw)
+{
+  int32_t a = draw & 0xFFFF;
+  int32_t b = draw >> 16;
+  return (a - b) * (1.0f / 65536.0f);
+}
+
+#if defined(__SSE2__)
+__m128i hash4(__m128i x)
+{
+  for (int round = 0; round < 2; round++) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  }
+  return x;
+}
+
+__m128 tpdf4(__m128i draw)
+{
+  __m128i low = _mm_and_si128(draw, _mm_set1_epi32(0xFFFF));
+  __m128i high = _mm_srli_epi32(draw, 16);
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(low, high)),
+                    _mm_set1_ps(1.0f / 65536.0f));
+}
+
+__m128i weyl4(uint32_t counter)
+{
+  return _mm_setr_epi32(counter, counter + DITHER_STEP,
+                        counter + 2 * DITHER_STEP, counter + 3 * DITHER_STEP);
+}
+#endif
+
+// Fill `noise` with TPDF dither, in LSB.
+void tpdf_noise(float * noise, size_t count, dither_state * state)
+{
+  size_t i = 0;
+  uint32_t counter = state->counter;
+
+#if defined(__SSE2__)
+  __m128i weyl = weyl4(counter);
+  const __m128i step = _mm_set1_epi32(4 * DITHER_STEP);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(noise + i, tpdf4(hash4(weyl)));
+    weyl = _mm_add_epi32(weyl, step);
+  }
+  counter += i * DITHER_STEP;
+#endif
+
+  for (; i < count; i++) {
+    noise[i] = tpdf(hash(counter));
+    counter += DITHER_STEP;
+  }
+
+  state->counter = counter;
+}
+
+}
+
+void dsp_dither_init(dither_state * state, uint32_t seed)
+{
+  state->counter = seed;
+  state->error = 0.0f;
+}
+
+void dsp_quantize_tpdf(const float * in, int16_t * out, size_t count,
+                       float gain, dither_state * state)
+{
+  size_t i = 0;
+  uint32_t counter = state->counter;
+  const float factor = gain * INT16_SCALE;
+
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(factor);
+  const __m128 lower = _mm_set1_ps(INT16_MIN);
+  const __m128 upper = _mm_set1_ps(INT16_MAX);
+  __m128i weyl = weyl4(counter);
+  const __m128i step = _mm_set1_epi32(4 * DITHER_STEP);
+  for (; i + 4 <= count; i += 4) {
+    __m128 value = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(in + i), scale),
+                              tpdf4(hash4(weyl)));
+    weyl = _mm_add_epi32(weyl, step);
+    value = _mm_min_ps(_mm_max_ps(value, lower), upper);
+    __m128i rounded = _mm_cvtps_epi32(value);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i),
+                     _mm_packs_epi32(rounded, rounded));
+  }
+  counter += i * DITHER_STEP;
+#endif
+
+  for (; i < count; i++) {
+    out[i] = clip_lsb(in[i] * factor + tpdf(hash(counter)));
+    counter += DITHER_STEP;
+  }
+
+  state->counter = counter;
+}
+
+void dsp_quantize_shaped(const float * in, int16_t * out, size_t count,
+                         float gain, dither_state * state)
+{
+  const float factor = gain * INT16_SCALE;
+  // the feedback loop is sequential, only the noise generation is vectorized
+  const size_t BLOCK = 256;
+  float noise[BLOCK];
+  float error = state->error;
+
+  for (size_t offset = 0; offset < count; offset += BLOCK) {
+    size_t n = count - offset < BLOCK ? count - offset : BLOCK;
+    tpdf_noise(noise, n, state);
+    for (size_t i = 0; i < n; i++) {
+      float wanted = in[offset + i] * factor - error;
+      int16_t quantized = clip_lsb(wanted + noise[i]);
+      out[offset + i] = quantized;
+      // rounding and dither stay within 1.5 LSB, anything larger comes from
+      // clipping, and would make the loop unstable if fed back
+      error = quantized - wanted;
+      if (error > 2.0f || error < -2.0f) {
+        error = 0.0f;
+      }
+    }
+  }
+
+  state->error = error;
+}
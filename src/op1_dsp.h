@@ -0,0 +1,113 @@
+#ifndef OP1_DSP_H
+#define OP1_DSP_H
+
+/** @file
+ *     Vectorized kernels shared by the sample processing stages. Each kernel
+ *     has an AVX2 or SSE2 implementation, chosen at compile time, and a scalar
+ *     fallback. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Dot product of two arrays of `count` floats.
+ */
+float dsp_dot(const float * a, const float * b, size_t count);
+
+/**
+ * Convert `count` 16-bit samples to floats in [-1.0, 1.0).
+ */
+void dsp_int16_to_float(const int16_t * in, float * out, size_t count);
+
+/**
+ * Convert `count` floats, multiplied by `gain`, to 16-bit samples, rounding to
+ * the nearest value and clipping.
+ */
+void dsp_float_to_int16(const float * in, int16_t * out, size_t count,
+                        float gain);
+
+/**
+ * Measure the levels of `count` floats: raise `peak` to the largest absolute
+ * value found, and add their energy (sum of squares) to `energy`.
+ */
+void dsp_levels(const float * in, size_t count, float * peak, double * energy);
+
+/**
+ * Multiply `count` floats by `gain`, in place.
+ */
+void dsp_apply_gain(float * data, size_t count, float gain);
+
+/**
+ * Find the first of `count` floats whose absolute value is above `threshold`.
+ *
+ * @returns its index, or `count` if there is none.
+ */
+size_t dsp_find_first_above(const float * in, size_t count, float threshold);
+
+/**
+ * Find the last of `count` floats whose absolute value is above `threshold`.
+ *
+ * @returns its index, or `count` if there is none.
+ */
+size_t dsp_find_last_above(const float * in, size_t count, float threshold);
+
+/**
+ * Average the `channels` interleaved channels of `frame_count` frames into
+ * a mono signal.
+ */
+void dsp_downmix_average(const float * in, int channels, float * out,
+                         size_t frame_count);
+
+/**
+ * Average the first two of `channels` interleaved channels of `frame_count`
+ * frames into a mono signal.
+ */
+void dsp_downmix_mid(const float * in, int channels, float * out,
+                     size_t frame_count);
+
+/**
+ * Copy `channel` out of `channels` interleaved channels of `frame_count`
+ * frames into a mono signal.
+ */
+void dsp_extract_channel(const float * in, int channels, int channel,
+                         float * out, size_t frame_count);
+
+/**
+ * Add the energy (sum of squares) of each of the `channels` interleaved
+ * channels of `frame_count` frames to `energies`.
+ */
+void dsp_channel_energies(const float * in, int channels, size_t frame_count,
+                          double * energies);
+
+/**
+ * State of the dither generators, to carry from one block to the next.
+ */
+struct dither_state
+{
+  // position in the dither sequence
+  uint32_t counter;
+  // last quantization error, for noise shaping
+  float error;
+};
+
+/**
+ * Seed `state`, so that the same seed always gives the same dither.
+ */
+void dsp_dither_init(dither_state * state, uint32_t seed);
+
+/**
+ * Quantize `count` floats, multiplied by `gain`, to 16-bit, adding triangular
+ * (TPDF) dither of one LSB peak before rounding.
+ */
+void dsp_quantize_tpdf(const float * in, int16_t * out, size_t count,
+                       float gain, dither_state * state);
+
+/**
+ * Quantize `count` floats, multiplied by `gain`, to 16-bit with TPDF dither and
+ * first-order noise shaping, that moves the quantization noise towards high
+ * frequencies.
+ */
+void dsp_quantize_shaped(const float * in, int16_t * out, size_t count,
+                         float gain, dither_state * state);
+
+#endif // OP1_DSP_H
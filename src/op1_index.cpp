@@ -0,0 +1,468 @@
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <stdio.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+#include "op1.h"
+#include "op1_index.h"
+#include "op1_mmap.h"
+#include "op1_thread_pool.h"
+
+using namespace std;
+
+namespace {
+
+const char INDEX_MAGIC[4] = { 'O', 'P', '1', 'I' };
+// Bumped when the layout of a record changes.
+const uint32_t INDEX_VERSION = 1;
+
+uint64_t fnv1a(const uint8_t * data, size_t length)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Records are stored as a sequence of LEB128 integers, signed values being
+// zigzag encoded first, so that most parameters, being small, take one or two
+// bytes.
+struct index_writer
+{
+  void varint(uint64_t value)
+  {
+    while (value >= 0x80) {
+      bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+      value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+  }
+
+  void signed_varint(int64_t value)
+  {
+    varint((static_cast<uint64_t>(value) << 1) ^ (value >> 63));
+  }
+
+  void fixed64(uint64_t value)
+  {
+    for (int i = 0; i < 8; i++) {
+      bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+  }
+
+  void text(const string & value)
+  {
+    varint(value.size());
+    bytes.insert(bytes.end(), value.begin(), value.end());
+  }
+
+  template<size_t N>
+  void values(const array<int32_t, N> & values)
+  {
+    for (size_t i = 0; i < N; i++) {
+      signed_varint(values[i]);
+    }
+  }
+
+  vector<uint8_t> bytes;
+};
+
+// The reverse of `index_writer`. Reading past the end sets `failed`, and
+// returns zeros.
+struct index_reader
+{
+  index_reader(const uint8_t * data, size_t length)
+    : data(data)
+    , end(data + length)
+    , failed(false)
+  {}
+
+  uint64_t varint()
+  {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (data == end) {
+        break;
+      }
+      uint8_t byte = *data++;
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    failed = true;
+    return 0;
+  }
+
+  int64_t signed_varint()
+  {
+    uint64_t value = varint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  uint64_t fixed64()
+  {
+    if (end - data < 8) {
+      failed = true;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+      value |= static_cast<uint64_t>(*data++) << (8 * i);
+    }
+    return value;
+  }
+
+  string text()
+  {
+    uint64_t length = varint();
+    if (length > static_cast<uint64_t>(end - data)) {
+      failed = true;
+      return string();
+    }
+    string value(reinterpret_cast<const char *>(data), length);
+    data += length;
+    return value;
+  }
+
+  template<size_t N>
+  void values(array<int32_t, N> & values)
+  {
+    for (size_t i = 0; i < N; i++) {
+      values[i] = signed_varint();
+    }
+  }
+
+  const uint8_t * data;
+  const uint8_t * end;
+  bool failed;
+};
+
+void write_record(index_writer & out, const kit_record & record)
+{
+  out.text(record.path);
+  out.signed_varint(record.mtime);
+  out.varint(record.size);
+  out.fixed64(record.hash);
+  out.varint(record.rate);
+  out.varint(record.frame_count);
+  out.text(record.fx_type);
+  out.text(record.lfo_type);
+  out.varint(record.fx_active);
+  out.varint(record.lfo_active);
+  out.values(record.fx_params);
+  out.values(record.lfo_params);
+  out.values(record.enveloppe);
+  out.values(record.pitches);
+  out.values(record.volumes);
+  out.values(record.playmode);
+  out.values(record.playback_direction);
+  out.values(record.start_times);
+  out.values(record.end_times);
+}
+
+void read_record(index_reader & in, kit_record * record)
+{
+  record->path = in.text();
+  record->mtime = in.signed_varint();
+  record->size = in.varint();
+  record->hash = in.fixed64();
+  record->rate = in.varint();
+  record->frame_count = in.varint();
+  record->fx_type = in.text();
+  record->lfo_type = in.text();
+  record->fx_active = in.varint();
+  record->lfo_active = in.varint();
+  in.values(record->fx_params);
+  in.values(record->lfo_params);
+  in.values(record->enveloppe);
+  in.values(record->pitches);
+  in.values(record->volumes);
+  in.values(record->playmode);
+  in.values(record->playback_direction);
+  in.values(record->start_times);
+  in.values(record->end_times);
+}
+
+int64_t modification_time(const struct stat & st)
+{
+#ifdef __APPLE__
+  const struct timespec & time = st.st_mtimespec;
+#else
+  const struct timespec & time = st.st_mtim;
+#endif
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+bool is_kit_file(const char * name)
+{
+  const char * dot = strrchr(name, '.');
+  return dot && (!strcasecmp(dot, ".aif") || !strcasecmp(dot, ".aiff"));
+}
+
+// A kit file found while walking the library.
+struct found_file
+{
+  string path;
+  int64_t mtime;
+  uint64_t size;
+};
+
+// Add the kit files under `directory` to `files`, and the directories below
+// it that could not be read to `unreadable`, ending with a '/'. Symbolic links
+// to directories are not followed, so that there can't be a cycle.
+int walk(const string & directory, vector<found_file> & files,
+         vector<string> & unreadable)
+{
+  DIR * dir = opendir(directory.c_str());
+  if (!dir) {
+    return OP1_IO_ERROR;
+  }
+
+  while (struct dirent * entry = readdir(dir)) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    string path = directory + "/" + entry->d_name;
+    bool is_directory = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_directory = !lstat(path.c_str(), &st) && S_ISDIR(st.st_mode);
+    }
+    if (is_directory) {
+      if (walk(path, files, unreadable) != OP1_SUCCESS) {
+        unreadable.push_back(path + "/");
+      }
+      continue;
+    }
+    if (!is_kit_file(entry->d_name)) {
+      continue;
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    found_file file = { path, modification_time(st),
+                        static_cast<uint64_t>(st.st_size) };
+    files.push_back(file);
+  }
+
+  closedir(dir);
+
+  return OP1_SUCCESS;
+}
+
+bool by_path(const kit_record & a, const kit_record & b)
+{
+  return a.path < b.path;
+}
+}
+
+int index_read_kit(const char * path, kit_record * record)
+{
+  struct stat st;
+  if (stat(path, &st)) {
+    return OP1_IO_ERROR;
+  }
+
+  op1_drum * drum;
+  int rv = op1_drum_load(path, &drum);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  const char * fx;
+  const char * lfo;
+  op1_drum_get_fx(drum, &fx);
+  op1_drum_get_lfo(drum, &lfo);
+  record->path = path;
+  record->mtime = modification_time(st);
+  record->size = st.st_size;
+  record->fx_type = fx;
+  record->lfo_type = lfo;
+  op1_drum_get_fx_active(drum, &record->fx_active);
+  op1_drum_get_lfo_active(drum, &record->lfo_active);
+  op1_drum_get_fx_params(drum, record->fx_params.data());
+  op1_drum_get_lfo_params(drum, record->lfo_params.data());
+  op1_drum_get_enveloppe(drum, record->enveloppe.data());
+  op1_drum_get_pitches(drum, record->pitches.data());
+  op1_drum_get_volumes(drum, record->volumes.data());
+  op1_drum_get_playmode(drum, record->playmode.data());
+  op1_drum_get_playback_direction(drum, record->playback_direction.data());
+  op1_drum_get_start_times(drum, record->start_times.data());
+  op1_drum_get_end_times(drum, record->end_times.data());
+
+  record->rate = OP1_SAMPLE_RATE;
+  record->frame_count = 0;
+  audio_file * sample;
+  if (op1_drum_get_sample(drum, 0, &sample) == OP1_SUCCESS) {
+    int rate;
+    size_t frame_count;
+    op1_sample_get_rate(sample, &rate);
+    record->rate = rate;
+    if (op1_sample_get_length(sample, &frame_count) == OP1_SUCCESS) {
+      record->frame_count = frame_count;
+    }
+  }
+
+  op1_drum_destroy(drum);
+
+  mapped_file mapping;
+  rv = mapping.open(path, true);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+  record->hash = fnv1a(mapping.data(), mapping.size());
+
+  return OP1_SUCCESS;
+}
+
+int index_load(const char * path, vector<kit_record> * records)
+{
+  mapped_file mapping;
+  int rv = mapping.open(path, true);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+
+  records->clear();
+
+  if (mapping.size() < sizeof(INDEX_MAGIC) ||
+      memcmp(mapping.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC))) {
+    return OP1_ERROR;
+  }
+
+  index_reader in(mapping.data() + sizeof(INDEX_MAGIC),
+                  mapping.size() - sizeof(INDEX_MAGIC));
+  if (in.varint() != INDEX_VERSION) {
+    return OP1_SUCCESS;
+  }
+
+  uint64_t count = in.varint();
+  // each record takes at least a byte
+  if (count > mapping.size()) {
+    return OP1_ERROR;
+  }
+
+  records->resize(count);
+  for (size_t i = 0; i < count && !in.failed; i++) {
+    read_record(in, &(*records)[i]);
+  }
+
+  if (in.failed) {
+    records->clear();
+    return OP1_ERROR;
+  }
+
+  return OP1_SUCCESS;
+}
+
+int index_save(const char * path, const vector<kit_record> & records)
+{
+  index_writer out;
+  out.bytes.insert(out.bytes.end(), INDEX_MAGIC,
+                   INDEX_MAGIC + sizeof(INDEX_MAGIC));
+  out.varint(INDEX_VERSION);
+  out.varint(records.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    write_record(out, records[i]);
+  }
+
+  string temporary = string(path) + ".tmp";
+  FILE * f = fopen(temporary.c_str(), "wb");
+  if (!f) {
+    return OP1_IO_ERROR;
+  }
+
+  bool written = fwrite(out.bytes.data(), out.bytes.size(), 1, f) == 1;
+  if (fclose(f) || !written || rename(temporary.c_str(), path)) {
+    remove(temporary.c_str());
+    return OP1_IO_ERROR;
+  }
+
+  return OP1_SUCCESS;
+}
+
+int index_update(const char * root, unsigned threads,
+                 vector<kit_record> * records, index_stats * stats)
+{
+  memset(stats, 0, sizeof(*stats));
+
+  string directory(root);
+  while (directory.size() > 1 && directory.back() == '/') {
+    directory.pop_back();
+  }
+
+  vector<found_file> files;
+  vector<string> unreadable;
+  int rv = walk(directory, files, unreadable);
+  if (rv != OP1_SUCCESS) {
+    return rv;
+  }
+  stats->unreadable = unreadable.size();
+
+  unordered_map<string, size_t> known;
+  for (size_t i = 0; i < records->size(); i++) {
+    known[(*records)[i].path] = i;
+  }
+
+  // records of other directories are not ours to remove, and those of the
+  // directories we could not read may still be right
+  string prefix = directory + "/";
+  vector<kit_record> updated;
+  for (size_t i = 0; i < records->size(); i++) {
+    const string & path = (*records)[i].path;
+    bool outside = path.compare(0, prefix.size(), prefix) != 0;
+    for (size_t j = 0; !outside && j < unreadable.size(); j++) {
+      outside = !path.compare(0, unreadable[j].size(), unreadable[j]);
+    }
+    if (outside) {
+      updated.push_back((*records)[i]);
+    }
+  }
+  size_t outside = updated.size();
+
+  vector<const found_file *> changed;
+  for (size_t i = 0; i < files.size(); i++) {
+    auto it = known.find(files[i].path);
+    if (it != known.end()) {
+      const kit_record & record = (*records)[it->second];
+      if (record.mtime == files[i].mtime && record.size == files[i].size) {
+        updated.push_back(record);
+        continue;
+      }
+    }
+    changed.push_back(&files[i]);
+  }
+  stats->kept = updated.size() - outside;
+  stats->removed = records->size() - outside - stats->kept;
+
+  vector<kit_record> read(changed.size());
+  vector<int> results(changed.size());
+  parallel_for(changed.size(), threads, [&](size_t i) {
+    results[i] = index_read_kit(changed[i]->path.c_str(), &read[i]);
+  });
+
+  for (size_t i = 0; i < changed.size(); i++) {
+    if (known.count(changed[i]->path)) {
+      // replaced or failed, not removed
+      stats->removed--;
+    }
+    if (results[i] != OP1_SUCCESS) {
+      stats->failed++;
+      continue;
+    }
+    updated.push_back(read[i]);
+    stats->indexed++;
+  }
+
+  sort(updated.begin(), updated.end(), by_path);
+  records->swap(updated);
+
+  return OP1_SUCCESS;
+}
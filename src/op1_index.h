@@ -0,0 +1,104 @@
+#ifndef OP1_INDEX_H
+#define OP1_INDEX_H
+
+/** @file
+ *     An on-disk index of the drum kits of a library, that is updated
+ *     incrementally and can be queried without reading the kits. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <string>
+#include <vector>
+
+/**
+ * What the index knows about a drum kit: the file it was read from, and the
+ * parameters of its 'op-1' APPL document.
+ */
+struct kit_record
+{
+  std::string path;
+  // Modification time, in nanoseconds since the epoch, and size of the file
+  // when it was indexed. A file that has changed either is read again.
+  int64_t mtime;
+  uint64_t size;
+  // 64-bit FNV-1a hash of the whole file.
+  uint64_t hash;
+  uint32_t rate;
+  // The length of the audio of the kit.
+  uint32_t frame_count;
+  std::string fx_type;
+  std::string lfo_type;
+  int32_t fx_active;
+  int32_t lfo_active;
+  std::array<int32_t, 8> fx_params;
+  std::array<int32_t, 8> lfo_params;
+  std::array<int32_t, 8> enveloppe;
+  std::array<int32_t, 24> pitches;
+  std::array<int32_t, 24> volumes;
+  std::array<int32_t, 24> playmode;
+  std::array<int32_t, 24> playback_direction;
+  // Slot boundaries, in frames.
+  std::array<int32_t, 24> start_times;
+  std::array<int32_t, 24> end_times;
+};
+
+/**
+ * What `index_update` did.
+ */
+struct index_stats
+{
+  // Files that had not changed since they were indexed.
+  size_t kept;
+  // Files that were read, because they are new or have changed.
+  size_t indexed;
+  // Files that could not be read, or are not drum kits.
+  size_t failed;
+  // Records of files that are not there anymore.
+  size_t removed;
+  // Directories that could not be read. The records of their files are left
+  // as is.
+  size_t unreadable;
+};
+
+/**
+ * Read the drum kit `path` into `record`.
+ *
+ * @returns OP1_IO_ERROR if the file could not be read, OP1_ERROR if it is not
+ * an OP-1 drum kit, OP1_SUCCESS otherwise.
+ */
+int index_read_kit(const char * path, kit_record * record);
+
+/**
+ * Read the index stored at `path`. An index written by another version of
+ * this code is read as empty, and rebuilt on update.
+ *
+ * @returns OP1_IO_ERROR if the file could not be read, OP1_ERROR if it is not
+ * an index, OP1_SUCCESS otherwise.
+ */
+int index_load(const char * path, std::vector<kit_record> * records);
+
+/**
+ * Write `records` to `path`, replacing what is there only once everything
+ * has been written.
+ *
+ * @returns OP1_IO_ERROR if the file could not be written, OP1_SUCCESS
+ * otherwise.
+ */
+int index_save(const char * path, const std::vector<kit_record> & records);
+
+/**
+ * Bring the records of the kits under the directory `root` up to date:
+ * read the `.aif` and `.aiff` files that are new or have changed, on at most
+ * `threads` threads, and drop the records of files that are gone. Records of
+ * files elsewhere, or in directories below `root` that could not be read, are
+ * left as is. `records` is kept sorted by path.
+ *
+ * @param threads The maximum number of threads, 0 for one per core.
+ *
+ * @returns OP1_IO_ERROR if `root` could not be read, OP1_SUCCESS otherwise.
+ */
+int index_update(const char * root, unsigned threads,
+                 std::vector<kit_record> * records, index_stats * stats);
+
+#endif // OP1_INDEX_H
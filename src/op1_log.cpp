@@ -0,0 +1,96 @@
+#include <cstdarg>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "op1.h"
+
+using namespace std;
+
+atomic<int> g_log_level(OP1_LOG_WARNING);
+
+namespace {
+const char * LEVEL_NAMES[] = { "Error", "Warning", "Info", "Debug" };
+
+// Prints like the library always did: warnings and errors as is, the other
+// messages with where they come from.
+void log_to_stderr(int level, const char * file, int line,
+                   const char * message, void * user_data)
+{
+  if (level <= OP1_LOG_WARNING) {
+    fprintf(stderr, "%s: %s\n", LEVEL_NAMES[level], message);
+  } else {
+    fprintf(stderr, "%s:%d: %s\n", file, line, message);
+  }
+}
+
+mutex g_log_lock;
+op1_log_callback g_log_callback = log_to_stderr;
+void * g_log_user_data = nullptr;
+}
+
+void op1_log(int level, const char * file, int line, const char * format, ...)
+{
+  char buffer[1024];
+  string longer;
+  const char * message = buffer;
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (length < 0) {
+    return;
+  }
+  if (static_cast<size_t>(length) >= sizeof(buffer)) {
+    try {
+      longer.resize(length + 1);
+      va_start(args, format);
+      vsnprintf(&longer[0], longer.size(), format, args);
+      va_end(args);
+      message = longer.c_str();
+    } catch (bad_alloc &) {
+      // called from C, the message is only truncated
+    }
+  }
+
+  // the callback is called without the lock, messages can come from any thread
+  op1_log_callback callback;
+  void * user_data;
+  {
+    lock_guard<mutex> lock(g_log_lock);
+    callback = g_log_callback;
+    user_data = g_log_user_data;
+  }
+
+  // the messages of the library end with a newline, the callbacks don't want
+  // it
+  size_t end = strlen(message);
+  if (end && message[end - 1] == '\n') {
+    if (message == buffer) {
+      buffer[end - 1] = '\0';
+    } else {
+      longer.resize(end - 1);
+      message = longer.c_str();
+    }
+  }
+
+  callback(level, file, line, message, user_data);
+}
+
+int op1_set_log_callback(int level, op1_log_callback callback, void * user_data)
+{
+  if (level < OP1_LOG_NONE || level > OP1_LOG_DEBUG) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  {
+    lock_guard<mutex> lock(g_log_lock);
+    g_log_callback = callback ? callback : log_to_stderr;
+    g_log_user_data = callback ? user_data : nullptr;
+  }
+  g_log_level.store(level, memory_order_relaxed);
+
+  return OP1_SUCCESS;
+}
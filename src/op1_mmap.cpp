@@ -0,0 +1,60 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "op1.h"
+#include "op1_mmap.h"
+
+mapped_file::mapped_file()
+  : m_data(nullptr)
+  , m_size(0)
+{
+}
+
+mapped_file::~mapped_file()
+{
+  close();
+}
+
+int mapped_file::open(const char * file_name, bool sequential)
+{
+  close();
+
+  int fd = ::open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return OP1_IO_ERROR;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size <= 0) {
+    ::close(fd);
+    return OP1_IO_ERROR;
+  }
+
+  void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the descriptor is closed
+  ::close(fd);
+
+  if (addr == MAP_FAILED) {
+    return OP1_IO_ERROR;
+  }
+
+  if (sequential) {
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  m_data = static_cast<const uint8_t*>(addr);
+  m_size = st.st_size;
+
+  return OP1_SUCCESS;
+}
+
+void mapped_file::close()
+{
+  if (m_data) {
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+  }
+  m_data = nullptr;
+  m_size = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef OP1_MMAP_H
+#define OP1_MMAP_H
+
+/** @file
+ *     Read-only memory mapping of a whole file. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A file mapped read-only in memory, unmapped when this object goes away.
+ */
+class mapped_file
+{
+public:
+  mapped_file();
+  ~mapped_file();
+
+  /**
+   * Map `file_name` in memory.
+   *
+   * @param file_name The file to map, has to be non-null.
+   * @param sequential Hint that the file is going to be read front to back.
+   *
+   * @returns OP1_IO_ERROR if the file could not be mapped, OP1_SUCCESS
+   * otherwise.
+   */
+  int open(const char * file_name, bool sequential);
+
+  const uint8_t * data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  mapped_file(const mapped_file &);
+  mapped_file & operator=(const mapped_file &);
+
+  void close();
+
+  const uint8_t * m_data;
+  size_t m_size;
+};
+
+#endif // OP1_MMAP_H
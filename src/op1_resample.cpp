@@ -0,0 +1,162 @@
+#include <cmath>
+
+#include "op1.h"
+#include "op1_dsp.h"
+#include "op1_resample.h"
+
+using namespace std;
+
+namespace {
+const double PI = 3.14159265358979323846;
+
+// Above this many phases, the position of each output frame is rounded to the
+// closest of MAX_PHASES phases instead of being exact.
+const uint32_t MAX_PHASES = 4096;
+
+struct filter_quality
+{
+  // taps of a phase, when not decimating
+  uint32_t taps;
+  // cutoff, relative to the lowest Nyquist frequency
+  double cutoff;
+  // Kaiser window parameter
+  double beta;
+};
+
+bool quality_parameters(int quality, filter_quality * params)
+{
+  switch (quality) {
+    case OP1_RESAMPLE_FAST:
+      *params = { 16, 0.90, 5.0 };
+      return true;
+    case OP1_RESAMPLE_MEDIUM:
+      *params = { 32, 0.94, 7.0 };
+      return true;
+    case OP1_RESAMPLE_BEST:
+      *params = { 64, 0.96, 9.0 };
+      return true;
+    default:
+      return false;
+  }
+}
+
+uint64_t gcd(uint64_t a, uint64_t b)
+{
+  while (b) {
+    uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Zeroth-order modified Bessel function of the first kind.
+double bessel_i0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+double sinc(double x)
+{
+  if (fabs(x) < 1e-9) {
+    return 1.0;
+  }
+  return sin(PI * x) / (PI * x);
+}
+
+// One filter per phase, each `taps` long, stored contiguously.
+void build_filters(uint32_t phases, uint32_t taps, double cutoff, double beta,
+                   op1_vector<float> & filters)
+{
+  filters.resize(static_cast<size_t>(phases) * taps);
+
+  double half = taps / 2.0;
+  double norm = bessel_i0(beta);
+
+  for (uint32_t p = 0; p < phases; p++) {
+    float * filter = filters.data() + static_cast<size_t>(p) * taps;
+    double fraction = static_cast<double>(p) / phases;
+    double sum = 0.0;
+
+    for (uint32_t k = 0; k < taps; k++) {
+      // distance between this tap and the output position, in input frames
+      double x = k - half + 1 - fraction;
+      double w = x / half;
+      double window = fabs(w) >= 1.0 ? 0.0
+                                     : bessel_i0(beta * sqrt(1.0 - w * w)) / norm;
+      double coefficient = cutoff * sinc(cutoff * x) * window;
+      filter[k] = coefficient;
+      sum += coefficient;
+    }
+
+    // unity gain at DC for every phase
+    for (uint32_t k = 0; k < taps; k++) {
+      filter[k] /= sum;
+    }
+  }
+}
+}
+
+int resample(const float * input, size_t frame_count, uint32_t in_rate,
+             uint32_t out_rate, int quality, op1_vector<float> & output)
+{
+  filter_quality params;
+
+  if (!in_rate || !out_rate || !quality_parameters(quality, &params)) {
+    return OP1_ARGUMENT_ERROR;
+  }
+
+  if (in_rate == out_rate) {
+    output.assign(input, input + frame_count);
+    return OP1_SUCCESS;
+  }
+
+  // output frame n is at input position n * step / phases
+  uint64_t divisor = gcd(in_rate, out_rate);
+  uint64_t phases = out_rate / divisor;
+  uint64_t step = in_rate / divisor;
+  bool exact = phases <= MAX_PHASES;
+  uint32_t table_phases = exact ? phases : MAX_PHASES;
+
+  double ratio = static_cast<double>(out_rate) / in_rate;
+  double cutoff = params.cutoff * min(1.0, ratio);
+  // widen the filter when decimating, to keep the same transition band, and
+  // keep it a multiple of 8 for the vector kernels
+  uint32_t taps = ceil(params.taps / min(1.0, ratio));
+  taps = (taps + 7) & ~7u;
+
+  op1_vector<float> filters;
+  build_filters(table_phases, taps, cutoff, params.beta, filters);
+
+  // zero-padded copy of the input, so that every filter reads in bounds
+  size_t pre = taps / 2 - 1;
+  op1_vector<float> padded(pre + frame_count + taps, 0.0f);
+  copy(input, input + frame_count, padded.begin() + pre);
+
+  size_t out_count = (static_cast<uint64_t>(frame_count) * phases + step - 1) / step;
+  output.resize(out_count);
+
+  for (size_t n = 0; n < out_count; n++) {
+    uint64_t position = n * step;
+    size_t index = position / phases;
+    uint64_t phase = position % phases;
+    if (!exact) {
+      phase = (phase * MAX_PHASES + phases / 2) / phases;
+      if (phase == MAX_PHASES) {
+        phase = 0;
+        index++;
+      }
+    }
+    const float * filter = filters.data() + phase * taps;
+    // tap k reads input frame index - taps / 2 + 1 + k
+    output[n] = dsp_dot(filter, padded.data() + index, taps);
+  }
+
+  return OP1_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#ifndef OP1_RESAMPLE_H
+#define OP1_RESAMPLE_H
+
+/** @file
+ *     Polyphase windowed-sinc sample-rate conversion. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "op1_alloc.h"
+
+/**
+ * Convert `frame_count` mono frames from `in_rate` to `out_rate`.
+ *
+ * @param quality One of `OP1_RESAMPLE_FAST`, `OP1_RESAMPLE_MEDIUM` or
+ * `OP1_RESAMPLE_BEST`.
+ * @param output Filled in with the converted frames.
+ *
+ * @returns OP1_ARGUMENT_ERROR for an unknown quality or rate, OP1_SUCCESS
+ * otherwise.
+ */
+int resample(const float * input, size_t frame_count, uint32_t in_rate,
+             uint32_t out_rate, int quality, op1_vector<float> & output);
+
+#endif // OP1_RESAMPLE_H
@@ -0,0 +1,76 @@
+#ifndef OP1_THREAD_POOL_H
+#define OP1_THREAD_POOL_H
+
+/** @file
+ *     A bounded set of worker threads, that run a function over a range of
+ *     indices. */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * The number of workers to use when none has been asked for: one per core.
+ */
+inline unsigned default_thread_count()
+{
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+  // no threads on the web without SharedArrayBuffer
+  return 1;
+#else
+  unsigned cores = std::thread::hardware_concurrency();
+  return cores ? cores : 1;
+#endif
+}
+
+/**
+ * Call `fn(i)` for every `i` in [0, count), on at most `threads` threads, the
+ * calling thread being one of them. Indices are handed out one at a time, so
+ * that a slow item does not hold up the others. Returns when all the calls
+ * have returned. `fn` must not throw. If threads can't be started, the ones
+ * that could and the calling thread do all the work.
+ *
+ * @param threads The maximum number of threads, 0 for `default_thread_count()`.
+ */
+template<typename F>
+void parallel_for(size_t count, unsigned threads, F fn)
+{
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+  threads = 1;
+#else
+  if (!threads) {
+    threads = default_thread_count();
+  }
+#endif
+  if (threads > count) {
+    threads = count;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (;;) {
+      size_t i = next.fetch_add(1, std::memory_order_relaxed);
+      if (i >= count) {
+        return;
+      }
+      fn(i);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  try {
+    workers.reserve(threads ? threads - 1 : 0);
+    for (unsigned i = 1; i < threads; i++) {
+      workers.emplace_back(worker);
+    }
+  } catch (...) {
+    // std::system_error when out of threads, std::bad_alloc: carry on with
+    // the workers that have started
+  }
+  worker();
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+}
+
+#endif // OP1_THREAD_POOL_H
@@ -110,24 +110,39 @@ function op1web_drum_add_sample(drum_ctx, sample) {
 }
 
 function op1web_drum_write_buffer(drum_ctx) {
-  var uint8_ptr_ptr = Module._malloc(4);
   var length_ptr = Module._malloc(4);
 
-  rv = Module.ccall('op1_drum_write_buffer',
+  rv = Module.ccall('op1_drum_get_output_size',
                     'number',
-                    ['number', 'number', 'number'],
-                    [drum_ctx, uint8_ptr_ptr, length_ptr]);
+                    ['number', 'number'],
+                    [drum_ctx, length_ptr]);
 
   if (rv != 0) {
-    console.log("Could not render buffer.");
+    console.log("Could not compute the output size.");
+    Module._free(length_ptr);
+    return rv;
   }
 
   length = Module.getValue(length_ptr, 'i32*');
-  uint8_ptr = Module.getValue(uint8_ptr_ptr, 'u8*');
+  Module._free(length_ptr);
+
+  // Render straight into a region of the heap, that is then handed out as-is.
+  var uint8_ptr = Module._malloc(length);
+
+  rv = Module.ccall('op1_drum_write_into',
+                    'number',
+                    ['number', 'number', 'number'],
+                    [drum_ctx, uint8_ptr, length]);
+
+  if (rv != 0) {
+    console.log("Could not render buffer.");
+    Module._free(uint8_ptr);
+    return rv;
+  }
 
-  console.log("length:" + length); 
+  console.log("length:" + length);
 
-  return Module.HEAP8.subarray(uint8_ptr, uint8_ptr + length);
+  return Module.HEAPU8.subarray(uint8_ptr, uint8_ptr + length);
 }
 
 function init() {